@@ -15,6 +15,16 @@
 #include <linux/device.h>
 #include <linux/kdev_t.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+
+#include "pcd_stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "pcd_trace.h"
 
 #undef pr_fmt
 #define pr_fmt(fmt) "[%s]: " fmt, __func__
@@ -25,7 +35,18 @@
 
 #define MEM_SIZE        512
 
-char device_buffer[MEM_SIZE];
+/* Device size can be raised at load time, e.g. insmod pcd.ko mem_size=67108864 */
+unsigned int mem_size = MEM_SIZE;
+module_param(mem_size, uint, S_IRUGO);
+MODULE_PARM_DESC(mem_size, "Size of the pseudo device in bytes");
+
+/* Backing pages of the device, allocated on first access */
+struct page **device_pages;
+unsigned long device_nr_pages;
+
+/* Per-CPU I/O statistics, read through <debugfs>/pcd_class/pcd/stats */
+struct pcd_stats __percpu *device_stats;
+struct dentry *debugfs_root;
 
 dev_t device_number;
 
@@ -35,60 +56,196 @@ struct cdev pcd_cdev = {
 struct class *class_pcd;
 struct device *device_pcd;
 
+/* The prototype functions for the page backed device buffer */
+struct page *pcd_buffer_page(unsigned long index, bool alloc);
+ssize_t pcd_buffer_read(struct iov_iter *to, size_t count, loff_t pos);
+ssize_t pcd_buffer_write(struct iov_iter *from, size_t count, loff_t pos, bool nowait);
+void pcd_buffer_free(void);
+
 /* The prototype functions for the character driver -- must come before the struct definition */
 int pcd_open(struct inode *inode, struct file *filp);
 int pcd_release(struct inode *inode, struct file *filp);
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t *f_pos);
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos);
+ssize_t pcd_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_write_iter(struct kiocb *iocb, struct iov_iter *from);
 loff_t pcd_lseek(struct file *filp, loff_t offset, int whence);
+int pcd_mmap(struct file *filp, struct vm_area_struct *vma);
 
 struct file_operations pcd_fops = {
     .open = pcd_open,
-    .write = pcd_write,
-    .read = pcd_read,
+    .write_iter = pcd_write_iter,
+    .read_iter = pcd_read_iter,
     .release = pcd_release,
     .llseek = pcd_lseek,
+    .mmap = pcd_mmap,
+    /* splice/sendfile run through read_iter/write_iter, device pages are handed to the pipe by reference */
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
     .owner = THIS_MODULE
 };
 
+/* Read only stats file, see pcd_stats.h */
+DEFINE_SHOW_ATTRIBUTE(pcd_stats);
+
+/* Look up the page backing a page index of the device, optionally allocating a zeroed one */
+struct page *pcd_buffer_page(unsigned long index, bool alloc) {
+
+    struct page *page, *old;
+
+    page = READ_ONCE(device_pages[index]);
+    if (page || !alloc)
+        return page;
+
+    page = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+    if (!page)
+        return ERR_PTR(-ENOMEM);
+
+    /* Concurrent writers may fault in the same page, only one of them wins */
+    old = cmpxchg(&device_pages[index], NULL, page);
+    if (old) {
+        __free_page(page);
+        page = old;
+    }
+
+    return page;
+}
+
+/* Copy count bytes at pos into the iterator page by page, holes read back as zeroes */
+ssize_t pcd_buffer_read(struct iov_iter *to, size_t count, loff_t pos) {
+
+    size_t done = 0, chunk, copied;
+    unsigned long offset;
+    struct page *page;
+
+    while (done < count) {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - done);
+
+        page = pcd_buffer_page((pos + done) >> PAGE_SHIFT, false);
+        if (page)
+            copied = copy_page_to_iter(page, offset, chunk, to);
+        else
+            copied = iov_iter_zero(chunk, to);
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    return (done || !count) ? done : -EFAULT;
+}
+
+/* Copy count bytes from the iterator to pos, allocating the pages being written */
+ssize_t pcd_buffer_write(struct iov_iter *from, size_t count, loff_t pos, bool nowait) {
+
+    size_t done = 0, chunk, copied;
+    unsigned long offset;
+    struct page *page;
+
+    while (done < count) {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - done);
+
+        /* A nowait writer must not block in the page allocator */
+        page = pcd_buffer_page((pos + done) >> PAGE_SHIFT, !nowait);
+        if (IS_ERR_OR_NULL(page)) {
+            if (done)
+                break;
+            return page ? PTR_ERR(page) : -EAGAIN;
+        }
+
+        copied = copy_page_from_iter(page, offset, chunk, from);
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    return (done || !count) ? done : -EFAULT;
+}
+
+/* Release every allocated page and the page array */
+void pcd_buffer_free(void) {
+
+    unsigned long i;
+
+    /* Pages still mapped by user space keep their own reference until munmap */
+    for (i = 0; i < device_nr_pages; i++)
+        if (device_pages[i])
+            put_page(device_pages[i]);
+
+    kvfree(device_pages);
+}
+
 int pcd_open(struct inode *inode, struct file *filp) {
+
+    /* Reads and writes honour IOCB_NOWAIT, so preadv2/pwritev2 may use RWF_NOWAIT */
+    filp->f_mode |= FMODE_NOWAIT;
+
     pr_info("Opened successful\n");
     return 0;
 }
 
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t *f_pos) {
+ssize_t pcd_read_iter(struct kiocb *iocb, struct iov_iter *to) {
 
-    /* Ajust the count argument */
-    if ((*f_pos + count) > MEM_SIZE)
-        count = MEM_SIZE - *f_pos;
+    ssize_t ret;
+    size_t count = iov_iter_count(to);
+    size_t requested = count;
+    loff_t pos = iocb->ki_pos;
+    /* Only read the clock when somebody listens to the tracepoint */
+    u64 start = trace_pcd_read_enabled() ? ktime_get_ns() : 0;
+
+    /* Ajust the count argument, pread may start beyond the end of the device */
+    if (pos >= mem_size)
+        count = 0;
+    else if ((pos + count) > mem_size)
+        count = mem_size - pos;
+
+    ret = pcd_buffer_read(to, count, pos);
+    if (ret < 0)
+        goto out;
 
-    if (copy_to_user(buff, device_buffer, count))
-        return -EFAULT;
-    
     /* Update current file position */
-    *f_pos += count;
-    pr_info("Number of bytes successfully read = %zu\n", count);
+    iocb->ki_pos += ret;
 
-    return count;
+out:
+    pcd_stats_io(device_stats, false, requested, ret);
+    trace_pcd_read(file_inode(iocb->ki_filp)->i_rdev, pos, requested, ret,
+                   start ? ktime_get_ns() - start : 0);
+    return ret;
 }
 
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos) {
+ssize_t pcd_write_iter(struct kiocb *iocb, struct iov_iter *from) {
 
-    /* Ajust the count argument */
-    if ((*f_pos + count) > MEM_SIZE)
-        count = MEM_SIZE - *f_pos;
+    ssize_t ret;
+    size_t count = iov_iter_count(from);
+    size_t requested = count;
+    loff_t pos = iocb->ki_pos;
+    /* Only read the clock when somebody listens to the tracepoint */
+    u64 start = trace_pcd_write_enabled() ? ktime_get_ns() : 0;
 
-    if (!count)
-        return -ENOMEM;
+    /* Ajust the count argument, pwrite may start beyond the end of the device */
+    if (pos >= mem_size)
+        count = 0;
+    else if ((pos + count) > mem_size)
+        count = mem_size - pos;
+
+    if (!count) {
+        ret = -ENOMEM;
+        goto out;
+    }
 
-    if (copy_from_user(device_buffer, buff, count))
-        return -EFAULT;
+    ret = pcd_buffer_write(from, count, pos, iocb->ki_flags & IOCB_NOWAIT);
+    if (ret < 0)
+        goto out;
 
     /* Update current file position */
-    *f_pos += count;
-    pr_info("Number of bytes successfully written = %zu\n", count);
+    iocb->ki_pos += ret;
 
-    return count;
+out:
+    pcd_stats_io(device_stats, true, requested, ret);
+    trace_pcd_write(file_inode(iocb->ki_filp)->i_rdev, pos, requested, ret,
+                    start ? ktime_get_ns() - start : 0);
+    return ret;
 }
 
 loff_t pcd_lseek(struct file *filp, loff_t offset, int whence) {
@@ -97,19 +254,19 @@ loff_t pcd_lseek(struct file *filp, loff_t offset, int whence) {
 
     switch (whence) {
         case SEEK_SET:
-            if ((offset > MEM_SIZE) || (offset < 0))
+            if ((offset > mem_size) || (offset < 0))
                 return -EINVAL;
             filp->f_pos = offset;
             break;
         case SEEK_CUR:
             temp = filp->f_pos + offset;
-            if ((temp > MEM_SIZE) || (temp < 0))
+            if ((temp > mem_size) || (temp < 0))
                 return -EINVAL;
             filp->f_pos = temp;
             break;
         case SEEK_END:
-            temp = MEM_SIZE + offset;
-            if ((temp > MEM_SIZE) || (temp < 0))
+            temp = mem_size + offset;
+            if ((temp > mem_size) || (temp < 0))
                 return -EINVAL;
             filp->f_pos = temp;
             break;
@@ -117,10 +274,37 @@ loff_t pcd_lseek(struct file *filp, loff_t offset, int whence) {
             return -EINVAL;
     }
 
-    pr_info("New value of the file position = %lld\n",filp->f_pos);
+    trace_pcd_lseek(file_inode(filp)->i_rdev, offset, whence, filp->f_pos);
     return filp->f_pos;
 }
 
+int pcd_mmap(struct file *filp, struct vm_area_struct *vma) {
+
+    unsigned long i;
+    struct page *page;
+
+    /*
+     * Only shared mappings make sense, private ones would hide the device content. Test VM_MAYSHARE:
+     * mmap() clears VM_SHARED of a MAP_SHARED mapping of a file opened read only
+     */
+    if (!(vma->vm_flags & VM_MAYSHARE))
+        return -EINVAL;
+
+    /* The mapping must stay inside the (page aligned) device buffer */
+    if ((vma->vm_pgoff >= device_nr_pages) || (vma_pages(vma) > device_nr_pages - vma->vm_pgoff))
+        return -EINVAL;
+
+    /* Populate the mapped range up front, so no fault handler is needed */
+    for (i = vma->vm_pgoff; i < vma->vm_pgoff + vma_pages(vma); i++) {
+        page = pcd_buffer_page(i, true);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+    }
+
+    /* The mapping holds its own references on the pages */
+    return vm_map_pages(vma, device_pages, device_nr_pages);
+}
+
 int pcd_release(struct inode *inode, struct file *filp) {
     pr_info("Released successful\n");
     return 0;
@@ -130,6 +314,21 @@ static int __init char_device_driver_init(void) {
 
     int ret;
 
+    if (!mem_size)
+        return -EINVAL;
+
+    /* Only the page array is allocated here, pages are allocated on first access */
+    device_nr_pages = DIV_ROUND_UP(mem_size, PAGE_SIZE);
+    device_pages = kvcalloc(device_nr_pages, sizeof(*device_pages), GFP_KERNEL);
+    if (!device_pages)
+        return -ENOMEM;
+
+    device_stats = pcd_stats_alloc();
+    if (!device_stats) {
+        ret = -ENOMEM;
+        goto error_out;
+    }
+
     /* Dynamically allocate a device number <one device> */
     ret = alloc_chrdev_region(&device_number, 0, 1, CHAR_NAME);
     if (ret < 0)
@@ -155,6 +354,10 @@ static int __init char_device_driver_init(void) {
         goto class_del;
     }
 
+    /* Statistics are optional, the driver works on without debugfs */
+    debugfs_root = debugfs_create_dir(CLASS_NAME, NULL);
+    debugfs_create_file("stats", S_IRUGO, debugfs_create_dir(DEV_NAME, debugfs_root), device_stats, &pcd_stats_fops);
+
     pr_info("Module init was successful\n");
 
     return 0;
@@ -166,15 +369,20 @@ cdev_del:
 unregister_char_dd:
     unregister_chrdev_region(device_number, 1);
 error_out:
+    free_percpu(device_stats);
+    kvfree(device_pages);
     return ret;
 }
 
 static void __exit char_device_driver_exit(void) {
 
+    debugfs_remove_recursive(debugfs_root);
     device_destroy(class_pcd, device_number);
     class_destroy(class_pcd);
     cdev_del(&pcd_cdev);
     unregister_chrdev_region(device_number, 1);
+    pcd_buffer_free();
+    free_percpu(device_stats);
     pr_info("Module unloaded\n");
 }
 
@@ -0,0 +1,502 @@
+/*
+ * @brief: Throughput/latency benchmark for the pcd devices (/dev/pcd, /dev/pcdev-N).
+ *         Sweeps request sizes, offsets, workers and devices, every combination
+ *         is one result row with ops/s, MB/s and p50/p99/p999 latency.
+ *         Build: gcc -O2 -Wall -pthread -o pcd_bench pcd_bench.c
+ * @author: NghiaPham
+ * @date: 2020/12/20
+ * @version: v0.1
+ *
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sched.h>
+
+#define MAX_LIST        32
+#define MAX_DEVICES     16
+#define DEFAULT_OPS     10000
+
+enum bench_mode {
+    MODE_READ,
+    MODE_WRITE,
+    MODE_MIXED,
+};
+
+enum out_format {
+    OUT_TEXT,
+    OUT_CSV,
+    OUT_JSON,
+};
+
+struct bench_config {
+    const char *devices[MAX_DEVICES];
+    int nr_devices;
+    long sizes[MAX_LIST];
+    int nr_sizes;
+    long offsets[MAX_LIST];
+    int nr_offsets;
+    long workers[MAX_LIST];
+    int nr_workers;
+    long ops;
+    long stride;
+    int read_percent;
+    enum bench_mode mode;
+    enum out_format format;
+    int use_process;
+    int pin_cpu;
+    const char *label;
+};
+
+/* One run = one combination of size, offset and worker count */
+struct bench_run {
+    const struct bench_config *cfg;
+    long size;
+    long offset;
+    long nr_workers;
+};
+
+/* Results of one worker, lives in shared memory when workers are processes */
+struct worker_result {
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t bytes;
+    long errors;
+    long done;
+    uint64_t *lat_ns;
+};
+
+struct worker_arg {
+    const struct bench_run *run;
+    int id;
+    struct worker_result *res;
+};
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *shared_alloc(size_t size, int use_process) {
+
+    void *p;
+
+    if (!use_process)
+        return calloc(1, size);
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+static void shared_free(void *p, size_t size, int use_process) {
+
+    if (!use_process)
+        free(p);
+    else if (p)
+        munmap(p, size);
+}
+
+static int parse_list(const char *arg, long *list, int max) {
+
+    char *copy, *tok, *save = NULL;
+    int n = 0;
+
+    copy = strdup(arg);
+    if (!copy)
+        return -1;
+
+    for (tok = strtok_r(copy, ",", &save); tok && n < max; tok = strtok_r(NULL, ",", &save)) {
+        char *end;
+        long val = strtol(tok, &end, 0);
+
+        /* Accept the usual k/m suffixes for sizes and offsets */
+        if (*end == 'k' || *end == 'K')
+            val <<= 10;
+        else if (*end == 'm' || *end == 'M')
+            val <<= 20;
+        else if (*end != '\0')
+            n = -1;
+
+        if (n < 0 || val < 0)
+            break;
+        list[n++] = val;
+    }
+
+    free(copy);
+    return n > 0 ? n : -1;
+}
+
+static void *worker_fn(void *data) {
+
+    struct worker_arg *arg = data;
+    const struct bench_run *run = arg->run;
+    const struct bench_config *cfg = run->cfg;
+    struct worker_result *res = arg->res;
+    const char *dev = cfg->devices[arg->id % cfg->nr_devices];
+    unsigned int seed = arg->id * 7919 + 1;
+    /* With a stride every worker works on its own region of the device */
+    off_t offset = run->offset + arg->id * cfg->stride;
+    char *buf;
+    int fd;
+    long i;
+
+    buf = malloc(run->size ? run->size : 1);
+    if (!buf) {
+        res->errors = cfg->ops;
+        return NULL;
+    }
+    memset(buf, 'a' + arg->id % 26, run->size);
+
+    /* Open with the least access the mode needs, pcdev-1 is RDONLY and pcdev-2 is WRONLY */
+    if (cfg->mode == MODE_READ)
+        fd = open(dev, O_RDONLY);
+    else if (cfg->mode == MODE_WRITE)
+        fd = open(dev, O_WRONLY);
+    else
+        fd = open(dev, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "open %s: %s\n", dev, strerror(errno));
+        res->errors = cfg->ops;
+        free(buf);
+        return NULL;
+    }
+
+    /* Pin worker N to CPU N so scaling across cores is measured, not scheduler placement */
+    if (cfg->pin_cpu) {
+        cpu_set_t set;
+        long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        CPU_ZERO(&set);
+        CPU_SET(arg->id % (nr_cpus > 0 ? nr_cpus : 1), &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    res->start_ns = now_ns();
+    for (i = 0; i < cfg->ops; i++) {
+        int do_read;
+        ssize_t ret;
+        uint64_t t0;
+
+        if (cfg->mode == MODE_MIXED)
+            do_read = (rand_r(&seed) % 100) < cfg->read_percent;
+        else
+            do_read = (cfg->mode == MODE_READ);
+
+        t0 = now_ns();
+        if (do_read)
+            ret = pread(fd, buf, run->size, offset);
+        else
+            ret = pwrite(fd, buf, run->size, offset);
+        res->lat_ns[i] = now_ns() - t0;
+
+        if (ret < 0)
+            res->errors++;
+        else
+            res->bytes += ret;
+    }
+    res->end_ns = now_ns();
+    res->done = i;
+
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, long n, double p) {
+
+    long idx;
+
+    if (!n)
+        return 0;
+    idx = (long)(p * (n - 1) + 0.5);
+    return sorted[idx];
+}
+
+static const char *mode_name(enum bench_mode mode) {
+
+    switch (mode) {
+        case MODE_READ:
+            return "read";
+        case MODE_WRITE:
+            return "write";
+        default:
+            return "mixed";
+    }
+}
+
+static void print_header(const struct bench_config *cfg) {
+
+    if (cfg->format == OUT_CSV)
+        printf("label,mode,devices,workers,size,offset,ops,errors,ops_per_sec,mb_per_sec,p50_ns,p99_ns,p999_ns\n");
+    else if (cfg->format == OUT_JSON)
+        printf("[\n");
+    else
+        printf("%-10s %-6s %4s %7s %8s %8s %10s %6s %12s %10s %9s %9s %9s\n", "label", "mode", "devs", "workers",
+               "size", "offset", "ops", "errors", "ops/s", "MB/s", "p50(ns)", "p99(ns)", "p999(ns)");
+}
+
+static void print_footer(const struct bench_config *cfg) {
+
+    if (cfg->format == OUT_JSON)
+        printf("\n]\n");
+}
+
+static int run_one(const struct bench_run *run, int first) {
+
+    const struct bench_config *cfg = run->cfg;
+    size_t res_size = run->nr_workers * sizeof(struct worker_result);
+    size_t lat_size = run->nr_workers * cfg->ops * sizeof(uint64_t);
+    struct worker_result *res;
+    struct worker_arg *args;
+    pthread_t *threads = NULL;
+    uint64_t *lat, start = UINT64_MAX, end = 0, bytes = 0;
+    long w, ops = 0, errors = 0;
+    double secs, ops_s, mb_s;
+    int ret = -1;
+
+    res = shared_alloc(res_size, cfg->use_process);
+    lat = shared_alloc(lat_size, cfg->use_process);
+    args = calloc(run->nr_workers, sizeof(*args));
+    if (!res || !lat || !args)
+        goto out;
+
+    for (w = 0; w < run->nr_workers; w++) {
+        res[w].lat_ns = lat + w * cfg->ops;
+        args[w].run = run;
+        args[w].id = w;
+        args[w].res = &res[w];
+    }
+
+    if (cfg->use_process) {
+        for (w = 0; w < run->nr_workers; w++) {
+            pid_t pid = fork();
+
+            if (pid < 0) {
+                perror("fork");
+                break;
+            }
+            if (!pid) {
+                worker_fn(&args[w]);
+                _exit(0);
+            }
+        }
+        while (wait(NULL) > 0)
+            ;
+    } else {
+        threads = calloc(run->nr_workers, sizeof(*threads));
+        if (!threads)
+            goto out;
+        for (w = 0; w < run->nr_workers; w++)
+            pthread_create(&threads[w], NULL, worker_fn, &args[w]);
+        for (w = 0; w < run->nr_workers; w++)
+            pthread_join(threads[w], NULL);
+    }
+
+    /* Wall time spans from the first worker start to the last worker end */
+    for (w = 0; w < run->nr_workers; w++) {
+        errors += res[w].errors;
+        if (!res[w].done)
+            continue;
+        if (res[w].start_ns < start)
+            start = res[w].start_ns;
+        if (res[w].end_ns > end)
+            end = res[w].end_ns;
+        /* Compact the samples so they can be sorted as one array */
+        memmove(lat + ops, res[w].lat_ns, res[w].done * sizeof(uint64_t));
+        ops += res[w].done;
+        bytes += res[w].bytes;
+    }
+    qsort(lat, ops, sizeof(uint64_t), cmp_u64);
+
+    secs = (end > start) ? (end - start) / 1e9 : 0;
+    ops_s = secs ? ops / secs : 0;
+    mb_s = secs ? bytes / secs / (1024 * 1024) : 0;
+
+    if (cfg->format == OUT_CSV)
+        printf("%s,%s,%d,%ld,%ld,%ld,%ld,%ld,%.0f,%.2f,%llu,%llu,%llu\n", cfg->label, mode_name(cfg->mode),
+               cfg->nr_devices, run->nr_workers, run->size, run->offset, ops, errors, ops_s, mb_s,
+               (unsigned long long)percentile(lat, ops, 0.50),
+               (unsigned long long)percentile(lat, ops, 0.99),
+               (unsigned long long)percentile(lat, ops, 0.999));
+    else if (cfg->format == OUT_JSON)
+        printf("%s  {\"label\": \"%s\", \"mode\": \"%s\", \"devices\": %d, \"workers\": %ld, \"size\": %ld, "
+               "\"offset\": %ld, \"ops\": %ld, \"errors\": %ld, \"ops_per_sec\": %.0f, "
+               "\"mb_per_sec\": %.2f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}",
+               first ? "" : ",\n", cfg->label, mode_name(cfg->mode), cfg->nr_devices, run->nr_workers,
+               run->size, run->offset, ops, errors, ops_s, mb_s,
+               (unsigned long long)percentile(lat, ops, 0.50),
+               (unsigned long long)percentile(lat, ops, 0.99),
+               (unsigned long long)percentile(lat, ops, 0.999));
+    else
+        printf("%-10s %-6s %4d %7ld %8ld %8ld %10ld %6ld %12.0f %10.2f %9llu %9llu %9llu\n",
+               cfg->label, mode_name(cfg->mode), cfg->nr_devices, run->nr_workers, run->size, run->offset,
+               ops, errors, ops_s, mb_s,
+               (unsigned long long)percentile(lat, ops, 0.50),
+               (unsigned long long)percentile(lat, ops, 0.99),
+               (unsigned long long)percentile(lat, ops, 0.999));
+    fflush(stdout);
+    ret = 0;
+
+out:
+    free(threads);
+    free(args);
+    shared_free(lat, lat_size, cfg->use_process);
+    shared_free(res, res_size, cfg->use_process);
+    return ret;
+}
+
+static void usage(const char *prog) {
+
+    printf("Usage: %s [options]\n", prog);
+    printf("  -d <device>     device node, repeat for several devices (default /dev/pcdev-1)\n");
+    printf("  -s <sizes>      request sizes, e.g. 1,64,512,4k (default 512)\n");
+    printf("  -o <offsets>    file offsets, e.g. 0,100 (default 0)\n");
+    printf("  -O <stride>     worker N uses offset + N * stride, e.g. disjoint regions (default 0)\n");
+    printf("  -t <workers>    worker counts, e.g. 1,2,4 (default 1)\n");
+    printf("  -P              workers are processes instead of threads\n");
+    printf("  -m <mode>       read, write or mixed (default read)\n");
+    printf("  -r <percent>    read percentage of the mixed mode (default 90)\n");
+    printf("  -n <ops>        operations per worker (default %d)\n", DEFAULT_OPS);
+    printf("  -f <format>     text, csv or json (default text)\n");
+    printf("  -a              pin worker N to CPU N\n");
+    printf("  -L <label>      label of every result row, e.g. the driver build or lock mode\n");
+    printf("Workers are spread round-robin over the devices.\n");
+    printf("E.g. %s -d /dev/pcdev-1 -d /dev/pcdev-2 -s 64,512 -t 1,4 -m mixed -f json\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config cfg = {
+        .sizes = { 512 }, .nr_sizes = 1,
+        .offsets = { 0 }, .nr_offsets = 1,
+        .workers = { 1 }, .nr_workers = 1,
+        .ops = DEFAULT_OPS,
+        .read_percent = 90,
+        .mode = MODE_READ,
+        .format = OUT_TEXT,
+        .label = "-",
+    };
+    int opt, s, o, w, first = 1;
+
+    while ((opt = getopt(argc, argv, "d:s:o:O:t:Pm:r:n:f:aL:h")) != -1) {
+        switch (opt) {
+            case 'd':
+                if (cfg.nr_devices == MAX_DEVICES) {
+                    fprintf(stderr, "At most %d devices\n", MAX_DEVICES);
+                    return 1;
+                }
+                cfg.devices[cfg.nr_devices++] = optarg;
+                break;
+            case 's':
+                cfg.nr_sizes = parse_list(optarg, cfg.sizes, MAX_LIST);
+                break;
+            case 'o':
+                cfg.nr_offsets = parse_list(optarg, cfg.offsets, MAX_LIST);
+                break;
+            case 'O':
+                if (parse_list(optarg, &cfg.stride, 1) != 1)
+                    goto bad_arg;
+                break;
+            case 't':
+                cfg.nr_workers = parse_list(optarg, cfg.workers, MAX_LIST);
+                break;
+            case 'P':
+                cfg.use_process = 1;
+                break;
+            case 'm':
+                if (strcmp(optarg, "read") == 0)
+                    cfg.mode = MODE_READ;
+                else if (strcmp(optarg, "write") == 0)
+                    cfg.mode = MODE_WRITE;
+                else if (strcmp(optarg, "mixed") == 0)
+                    cfg.mode = MODE_MIXED;
+                else
+                    goto bad_arg;
+                break;
+            case 'r':
+                cfg.read_percent = atoi(optarg);
+                if (cfg.read_percent < 0 || cfg.read_percent > 100)
+                    goto bad_arg;
+                break;
+            case 'n':
+                cfg.ops = atol(optarg);
+                if (cfg.ops <= 0)
+                    goto bad_arg;
+                break;
+            case 'f':
+                if (strcmp(optarg, "text") == 0)
+                    cfg.format = OUT_TEXT;
+                else if (strcmp(optarg, "csv") == 0)
+                    cfg.format = OUT_CSV;
+                else if (strcmp(optarg, "json") == 0)
+                    cfg.format = OUT_JSON;
+                else
+                    goto bad_arg;
+                break;
+            case 'a':
+                cfg.pin_cpu = 1;
+                break;
+            case 'L':
+                cfg.label = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                goto bad_arg;
+        }
+    }
+
+    if (cfg.nr_sizes < 0 || cfg.nr_offsets < 0 || cfg.nr_workers < 0)
+        goto bad_arg;
+
+    if (!cfg.nr_devices)
+        cfg.devices[cfg.nr_devices++] = "/dev/pcdev-1";
+
+    print_header(&cfg);
+    for (s = 0; s < cfg.nr_sizes; s++) {
+        for (o = 0; o < cfg.nr_offsets; o++) {
+            for (w = 0; w < cfg.nr_workers; w++) {
+                struct bench_run run = {
+                    .cfg = &cfg,
+                    .size = cfg.sizes[s],
+                    .offset = cfg.offsets[o],
+                    .nr_workers = cfg.workers[w] ? cfg.workers[w] : 1,
+                };
+
+                if (run_one(&run, first) < 0) {
+                    fprintf(stderr, "Cannot allocate the result buffers\n");
+                    return 1;
+                }
+                first = 0;
+            }
+        }
+    }
+    print_footer(&cfg);
+
+    return 0;
+
+bad_arg:
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,44 @@
+/*
+ * @brief: ioctl interface of pcd_multiple, shared by the driver and user space.
+ *         PCD_IOC_BATCH runs a vector of reads and writes on open pcdev-N files
+ *         in one syscall, every entry gets its own result.
+ * @author: NghiaPham
+ * @ver: v0.1
+ * @date: 2020/12/20
+ *
+*/
+
+#ifndef PCD_IOCTL_H
+#define PCD_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define PCD_IOC_MAGIC       'p'
+
+#define PCD_BATCH_READ      0
+#define PCD_BATCH_WRITE     1
+
+/* Entries a single PCD_IOC_BATCH may carry */
+#define PCD_BATCH_MAX       64
+
+/* One transfer of a batch, result is written back by the driver */
+struct pcd_batch_entry {
+    __s32 fd;                   /* Open pcdev file, opened for reading or writing as direction needs */
+    __u32 direction;            /* PCD_BATCH_READ or PCD_BATCH_WRITE */
+    __u64 offset;
+    __u64 length;
+    __u64 buf;                  /* User buffer of length bytes */
+    __s64 result;               /* Bytes transferred or -errno */
+};
+
+struct pcd_batch {
+    __u32 nr;                   /* Number of entries, 1 - PCD_BATCH_MAX */
+    __u32 pad;
+    __u64 entries;              /* User pointer to nr struct pcd_batch_entry */
+};
+
+/* Results are written back into the entries, so the argument goes both ways */
+#define PCD_IOC_BATCH       _IOWR(PCD_IOC_MAGIC, 1, struct pcd_batch)
+
+#endif // PCD_IOCTL_H
@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# @brief: Compare the lock modes of pcd_multiple.ko.
+#         Reloads the module once per lock_mode and runs pcd_bench on pcdev-3 (RDWR,
+#         1 KB) with 1..N pinned workers: a read mostly mix, then writers to disjoint
+#         128 byte regions. All rows go to one CSV file.
+# @author: NghiaPham
+# @date: 2020/12/20
+# @version: v0.2
+#
+# Usage: ./pcd_lock_bench.sh [read percent] [output.csv]
+
+READ_PERCENT=${1:-95}
+OUTPUT=${2:-pcd_lock_bench.csv}
+WORKERS=1,2,4,8
+MODES="mutex rwsem seqlock range"
+
+set -e
+
+[ -x ./pcd_bench ] || gcc -O2 -Wall -pthread -o pcd_bench pcd_bench.c
+
+# Keep the CSV header of the first run only
+append() {
+    if [ -s "$OUTPUT" ]; then tail -n +2; else cat; fi >> "$OUTPUT"
+}
+
+: > "$OUTPUT"
+lock_mode=0
+for name in $MODES; do
+    rmmod pcd_multiple 2>/dev/null || true
+    insmod pcd_multiple.ko lock_mode=$lock_mode
+
+    # Read scaling
+    ./pcd_bench -d /dev/pcdev-3 -s 64,512 -t $WORKERS -a -m mixed -r "$READ_PERCENT" \
+                -f csv -L "$name-read" | append
+
+    # Writer contention, every worker owns 128 bytes of the 1 KB device
+    ./pcd_bench -d /dev/pcdev-3 -s 128 -O 128 -t $WORKERS -a -m write \
+                -f csv -L "$name-disjoint" | append
+
+    lock_mode=$((lock_mode + 1))
+done
+rmmod pcd_multiple
+
+cat "$OUTPUT"
@@ -1,5 +1,5 @@
 /*
- * @brief: pseudo character device driver to support four pseudo character devices.
+ * @brief: pseudo character device driver to support multiple pseudo character devices.
  *         Implement open/release/read/write/lseek driver methods to handle user requests.
  * @author: NghiaPham
  * @ver: v0.1
@@ -13,14 +13,36 @@
 #include <linux/device.h>
 #include <linux/kdev_t.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/rwsem.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/llist.h>
+#include <linux/refcount.h>
+#include <linux/interval_tree_generic.h>
+#include <linux/workqueue.h>
+#include <linux/compat.h>
+
+#include "pcd_stats.h"
+#include "pcd_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "pcd_trace.h"
 
 #undef pr_fmt
 #define pr_fmt(fmt) "[%s]: " fmt, __func__
 
 #define CLASS_NAME      "pcd_class"
 #define DEV_NAME        "pcdevs"
-#define NO_OF_DEVICES   4
+#define NO_OF_DEVICES   4           /* Default number of devices */
+#define PCD_MAX_DEVICES 32          /* fifo_mask and frame_mask hold one bit per device */
 
 #define RDONLY          0x01
 #define WRONLY          0x02
@@ -30,79 +52,933 @@
 #define MEM_SIZE_PCD2   512
 #define MEM_SIZE_PCD3   1024
 #define MEM_SIZE_PCD4   512
+#define MEM_SIZE_PCD    1024        /* Size of the devices without a sizes entry */
 
-char device_buffer_pcd1[MEM_SIZE_PCD1];
-char device_buffer_pcd2[MEM_SIZE_PCD2];
-char device_buffer_pcd3[MEM_SIZE_PCD3];
-char device_buffer_pcd4[MEM_SIZE_PCD4];
+/* Largest device of the seqlock mode, its reads and writes copy the whole range with preemption off */
+#define PCD_SEQ_SIZE_MAX    1024
+
+/* How readers and writers of a random access device are serialized */
+enum pcd_lock_mode {
+    PCD_LOCK_MUTEX,             /* Everybody is serialized */
+    PCD_LOCK_RWSEM,             /* Readers run in parallel, writers are exclusive */
+    PCD_LOCK_SEQLOCK,           /* Reads take no lock and retry if a writer raced, devices up to 1 KB */
+    PCD_LOCK_RANGE,             /* Only overlapping byte ranges exclude each other */
+};
+
+/* A locked byte range [start, last] of a device, lives on the stack of the locker */
+struct pcd_range {
+    struct rb_node rb;
+    loff_t start;
+    loff_t last;
+    loff_t subtree_last;
+    bool write;                 /* Writers exclude everybody, readers only exclude writers */
+};
 
 /* Structure represents device private data */
 struct pcdev_private_data {
-    char *buffer;
+    struct page **pages;        /* Backing pages, allocated on demand */
+    unsigned long nr_pages;
     unsigned size;
-    const char *serial_number;
+    char serial_number[16];
     int permission;
     struct cdev cdev;
     struct mutex pcdev_lock;
+    unsigned int open_count;    /* Openers pinning the buffer, protected by pcdev_lock */
+    struct delayed_work idle_work;  /* Releases the buffer once the device stayed closed */
+    enum pcd_lock_mode lock_mode;
+    struct rw_semaphore pcdev_rwsem;    /* Device lock of the rwsem mode */
+    seqcount_t pcdev_seq;       /* Bumped by the writers of the seqlock mode */
+    spinlock_t range_lock;      /* Protects range_tree */
+    struct rb_root_cached range_tree;   /* Byte ranges held in the range mode */
+    wait_queue_head_t range_wq; /* Lockers waiting for a conflicting range to go */
+    bool fifo;                  /* FIFO mode, the page buffer is used as a ring */
+    unsigned long fifo_out;     /* Ring position of the oldest byte */
+    unsigned long fifo_len;     /* Bytes held by the ring */
+    unsigned int fifo_rd_threshold;
+    unsigned int fifo_wr_threshold;
+    wait_queue_head_t fifo_rq;  /* Readers waiting for data */
+    wait_queue_head_t fifo_wq;  /* Writers waiting for room */
+    bool frame;                 /* Frame mode, readers get whole frames published with RCU */
+    struct pcd_frame __rcu *frame_front;
+    struct llist_head frame_pool;   /* Spare back buffers, refilled after a grace period */
+    struct pcd_stats __percpu *stats;
+    struct dentry *debugfs;     /* <debugfs>/pcd_class/pcdev-N */
+};
+
+/* One frame of a frame mode device, the published one holds a reference of its own */
+struct pcd_frame {
+    struct rcu_head rcu;
+    struct llist_node node;
+    struct pcdev_private_data *dev_data;
+    refcount_t ref;
+    size_t size;
+    char data[];
 };
 
 /* Structure represents driver private data */
 struct pcdrv_private_data {
     int total_device;
-    struct pcdev_private_data pcdev_data[NO_OF_DEVICES];
+    struct pcdev_private_data *pcdev_data;
     dev_t device_number;
     struct class *class_pcd;
     struct device *device_pcd;
+    struct dentry *debugfs_root;
 };
 
-/* Initialization every device */
-struct pcdrv_private_data pcdrv_data = {
-    .total_device = NO_OF_DEVICES,
-    .pcdev_data = {
-            [0] = {
-                    .buffer = device_buffer_pcd1,
-                    .size = MEM_SIZE_PCD1,
-                    .serial_number = "PCD_DEV1",
-                    .permission = RDONLY
-            },
-            [1] = {
-                    .buffer = device_buffer_pcd2,
-                    .size = MEM_SIZE_PCD2,
-                    .serial_number = "PCD_DEV2",
-                    .permission = WRONLY
-            },
-            [2] = {
-                    .buffer = device_buffer_pcd3,
-                    .size = MEM_SIZE_PCD3,
-                    .serial_number = "PCD_DEV3",
-                    .permission = RDWR
-            },
-            [3] = {
-                    .buffer = device_buffer_pcd4,
-                    .size = MEM_SIZE_PCD4,
-                    .serial_number = "PCD_DEV4",
-                    .permission = RDWR
-            }
-    }
-};
+struct pcdrv_private_data pcdrv_data;
+
+/* Number of devices and their geometry, devices past the end of sizes/perms get the defaults */
+static unsigned int nr_devices = NO_OF_DEVICES;
+module_param(nr_devices, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_devices, "Number of pcdev devices (1 - 32)");
+
+static unsigned int sizes[PCD_MAX_DEVICES] = {MEM_SIZE_PCD1, MEM_SIZE_PCD2, MEM_SIZE_PCD3, MEM_SIZE_PCD4};
+module_param_array(sizes, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(sizes, "Comma separated buffer size in bytes of every device (default 1024)");
+
+static unsigned int perms[PCD_MAX_DEVICES] = {RDONLY, WRONLY, RDWR, RDWR};
+module_param_array(perms, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(perms, "Comma separated permission of every device: 1 = RDONLY, 2 = WRONLY, 3 = RDWR (default)");
+
+/* Buffers are allocated on first open, an idle device gives its memory back after this delay */
+static unsigned int idle_timeout;
+module_param(idle_timeout, uint, S_IRUGO);
+MODULE_PARM_DESC(idle_timeout, "Seconds after the last close before a device buffer and its content are released (0 = never)");
+
+static unsigned int lock_mode = PCD_LOCK_MUTEX;
+module_param(lock_mode, uint, S_IRUGO);
+MODULE_PARM_DESC(lock_mode, "Locking of random access devices: 0 = mutex, 1 = rwsem, 2 = seqlock, 3 = byte range");
+
+/* Devices whose bit is set work as a FIFO instead of a random access buffer */
+static unsigned int fifo_mask;
+module_param(fifo_mask, uint, S_IRUGO);
+MODULE_PARM_DESC(fifo_mask, "Bitmask of the devices working in FIFO mode (bit 0 = pcdev-1)");
+
+static unsigned int fifo_rd_threshold = 1;
+module_param(fifo_rd_threshold, uint, S_IRUGO);
+MODULE_PARM_DESC(fifo_rd_threshold, "Bytes a FIFO must hold before blocked readers are woken up");
+
+static unsigned int fifo_wr_threshold = 1;
+module_param(fifo_wr_threshold, uint, S_IRUGO);
+MODULE_PARM_DESC(fifo_wr_threshold, "Free bytes a FIFO must have before blocked writers are woken up");
+
+/* Devices whose bit is set publish whole frames, readers never see a half written buffer */
+static unsigned int frame_mask;
+module_param(frame_mask, uint, S_IRUGO);
+MODULE_PARM_DESC(frame_mask, "Bitmask of the devices working in frame mode (bit 0 = pcdev-1)");
+
+/* The prototype functions for the page backed device buffer */
+int pcd_buffer_init(struct pcdev_private_data *dev_data);
+void pcd_buffer_free(struct pcdev_private_data *dev_data);
+struct page *pcd_buffer_page(struct pcdev_private_data *dev_data, unsigned long index, bool alloc);
+int pcd_buffer_get(struct pcdev_private_data *dev_data);
+void pcd_buffer_put(struct pcdev_private_data *dev_data);
+void pcd_idle_work(struct work_struct *work);
+ssize_t pcd_buffer_read(struct pcdev_private_data *dev_data, struct iov_iter *to, size_t count, loff_t pos);
+ssize_t pcd_buffer_write(struct pcdev_private_data *dev_data, struct iov_iter *from, size_t count, loff_t pos, bool nowait);
+
+/* The prototype functions for the locking modes */
+void pcd_lock_init(struct pcdev_private_data *dev_data);
+void pcd_range_init(struct pcd_range *range, loff_t pos, size_t count, bool write);
+bool pcd_range_trylock(struct pcdev_private_data *dev_data, struct pcd_range *range);
+bool pcd_lock_try(struct pcdev_private_data *dev_data, struct pcd_range *range);
+int pcd_lock(struct pcdev_private_data *dev_data, struct pcd_range *range, bool nowait);
+void pcd_unlock(struct pcdev_private_data *dev_data, struct pcd_range *range);
+void pcd_buffer_peek(struct pcdev_private_data *dev_data, void *dst, size_t count, loff_t pos);
+void pcd_buffer_poke(struct pcdev_private_data *dev_data, const void *src, size_t count, loff_t pos);
+ssize_t pcd_seq_read(struct pcdev_private_data *dev_data, struct iov_iter *to, size_t count, loff_t pos, bool nowait);
+ssize_t pcd_seq_write(struct pcdev_private_data *dev_data, struct iov_iter *from, size_t count, loff_t pos, bool nowait);
+
+/* The prototype functions for the FIFO mode */
+void pcd_fifo_init(struct pcdev_private_data *dev_data, bool fifo);
+unsigned long pcd_fifo_len(struct pcdev_private_data *dev_data);
+ssize_t pcd_fifo_copy(struct pcdev_private_data *dev_data, struct iov_iter *iter, size_t count, unsigned long pos, bool write, bool nowait);
+ssize_t pcd_fifo_copy_to_pipe(struct pcdev_private_data *dev_data, struct iov_iter *to, size_t count, unsigned long pos);
+ssize_t pcd_fifo_read(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_fifo_write(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *from);
+
+/* The prototype functions for the frame mode */
+void pcd_frame_rcu(struct rcu_head *head);
+void pcd_frame_put(struct pcd_frame *frame);
+struct pcd_frame *pcd_frame_alloc(struct pcdev_private_data *dev_data, size_t size, gfp_t gfp);
+int pcd_frame_init(struct pcdev_private_data *dev_data);
+void pcd_frame_free(struct pcdev_private_data *dev_data);
+struct pcd_frame *pcd_frame_get(struct pcdev_private_data *dev_data);
+ssize_t pcd_frame_read(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_frame_write(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *from);
 
 /* The prototype functions for the character driver -- must come before the struct definition */
 int check_permission(int permission, int access_mode);
 int pcd_open(struct inode *inode, struct file *filp);
 int pcd_release(struct inode *inode, struct file *filp);
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t *f_pos);
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos);
+ssize_t pcd_dev_read(struct pcdev_private_data *pcdev_data, struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_dev_write(struct pcdev_private_data *pcdev_data, struct kiocb *iocb, struct iov_iter *from);
+ssize_t pcd_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_write_iter(struct kiocb *iocb, struct iov_iter *from);
 loff_t pcd_lseek(struct file *filp, loff_t offset, int whence);
+int pcd_mmap(struct file *filp, struct vm_area_struct *vma);
+__poll_t pcd_poll(struct file *filp, poll_table *wait);
+long pcd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+#ifdef CONFIG_COMPAT
+long pcd_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+#endif
+
+/* The prototype functions for the batch ioctl */
+int pcd_batch_check(struct file *file, struct pcd_batch_entry *entry);
+ssize_t pcd_batch_io(struct file *file, struct pcd_batch_entry *entry);
+long pcd_batch(struct file *filp, struct pcd_batch __user *ubatch);
 
 struct file_operations pcd_fops = {
     .open = pcd_open,
-    .write = pcd_write,
-    .read = pcd_read,
+    .write_iter = pcd_write_iter,
+    .read_iter = pcd_read_iter,
     .release = pcd_release,
     .llseek = pcd_lseek,
+    .mmap = pcd_mmap,
+    /* splice/sendfile run through read_iter/write_iter, device pages are handed to the pipe by reference */
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+    .poll = pcd_poll,
+    .unlocked_ioctl = pcd_ioctl,
+#ifdef CONFIG_COMPAT
+    .compat_ioctl = pcd_compat_ioctl,
+#endif
     .owner = THIS_MODULE
 };
 
+/* Read only <debugfs>/pcd_class/pcdev-N/stats, see pcd_stats.h */
+DEFINE_SHOW_ATTRIBUTE(pcd_stats);
+
+/* Allocate the page array of a device, the pages themselves are allocated on first use */
+int pcd_buffer_init(struct pcdev_private_data *dev_data) {
+
+    dev_data->nr_pages = DIV_ROUND_UP(dev_data->size, PAGE_SIZE);
+    dev_data->pages = kvcalloc(dev_data->nr_pages, sizeof(*dev_data->pages), GFP_KERNEL);
+    if (!dev_data->pages)
+        return -ENOMEM;
+
+    return 0;
+}
+
+/* Release every allocated page and the page array */
+void pcd_buffer_free(struct pcdev_private_data *dev_data) {
+
+    unsigned long i;
+
+    if (!dev_data->pages)
+        return;
+
+    /* Pages still mapped by user space keep their own reference until munmap */
+    for (i = 0; i < dev_data->nr_pages; i++)
+        if (dev_data->pages[i])
+            put_page(dev_data->pages[i]);
+
+    kvfree(dev_data->pages);
+    dev_data->pages = NULL;
+    dev_data->nr_pages = 0;
+}
+
+/* Pin the buffer of a device for a new opener, the first one allocates it. Caller holds pcdev_lock */
+int pcd_buffer_get(struct pcdev_private_data *dev_data) {
+
+    int ret;
+
+    /* The idle work rechecks open_count, so a release already running is harmless */
+    cancel_delayed_work(&dev_data->idle_work);
+
+    if (!dev_data->pages) {
+        ret = pcd_buffer_init(dev_data);
+        if (ret)
+            return ret;
+
+        ret = pcd_frame_init(dev_data);
+        if (ret) {
+            pcd_buffer_free(dev_data);
+            return ret;
+        }
+
+        /* A released FIFO starts over empty */
+        dev_data->fifo_out = 0;
+        WRITE_ONCE(dev_data->fifo_len, 0);
+    }
+
+    dev_data->open_count++;
+
+    return 0;
+}
+
+/* Unpin the buffer, the last closer arms the idle release. Caller holds pcdev_lock */
+void pcd_buffer_put(struct pcdev_private_data *dev_data) {
+
+    if (!--dev_data->open_count && idle_timeout)
+        schedule_delayed_work(&dev_data->idle_work, idle_timeout * HZ);
+}
+
+/* Give back the memory of a device nobody opened during idle_timeout */
+void pcd_idle_work(struct work_struct *work) {
+
+    struct pcdev_private_data *dev_data = container_of(to_delayed_work(work), struct pcdev_private_data, idle_work);
+
+    mutex_lock(&dev_data->pcdev_lock);
+    if (!dev_data->open_count && dev_data->pages) {
+        pcd_frame_free(dev_data);
+        pcd_buffer_free(dev_data);
+        pr_info("Released the buffer of idle device %s\n", dev_data->serial_number);
+    }
+    mutex_unlock(&dev_data->pcdev_lock);
+}
+
+/* Look up the page backing a page index of the device, optionally allocating a zeroed one */
+struct page *pcd_buffer_page(struct pcdev_private_data *dev_data, unsigned long index, bool alloc) {
+
+    struct page *page, *old;
+
+    page = READ_ONCE(dev_data->pages[index]);
+    if (page || !alloc)
+        return page;
+
+    page = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+    if (!page)
+        return ERR_PTR(-ENOMEM);
+
+    /* Concurrent writers may fault in the same page, only one of them wins */
+    old = cmpxchg(&dev_data->pages[index], NULL, page);
+    if (old) {
+        __free_page(page);
+        page = old;
+    }
+
+    return page;
+}
+
+/* Copy count bytes at pos into the iterator page by page, holes read back as zeroes */
+ssize_t pcd_buffer_read(struct pcdev_private_data *dev_data, struct iov_iter *to, size_t count, loff_t pos) {
+
+    size_t done = 0, chunk, copied;
+    unsigned long offset;
+    struct page *page;
+
+    while (done < count) {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - done);
+
+        page = pcd_buffer_page(dev_data, (pos + done) >> PAGE_SHIFT, false);
+        if (page)
+            copied = copy_page_to_iter(page, offset, chunk, to);
+        else
+            copied = iov_iter_zero(chunk, to);
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    return (done || !count) ? done : -EFAULT;
+}
+
+/* Copy count bytes from the iterator to pos, allocating the pages being written */
+ssize_t pcd_buffer_write(struct pcdev_private_data *dev_data, struct iov_iter *from, size_t count, loff_t pos, bool nowait) {
+
+    size_t done = 0, chunk, copied;
+    unsigned long offset;
+    struct page *page;
+
+    while (done < count) {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - done);
+
+        /* A nowait writer must not block in the page allocator */
+        page = pcd_buffer_page(dev_data, (pos + done) >> PAGE_SHIFT, !nowait);
+        if (IS_ERR_OR_NULL(page)) {
+            if (done)
+                break;
+            return page ? PTR_ERR(page) : -EAGAIN;
+        }
+
+        copied = copy_page_from_iter(page, offset, chunk, from);
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    return (done || !count) ? done : -EFAULT;
+}
+
+#define PCD_RANGE_START(range)  ((range)->start)
+#define PCD_RANGE_LAST(range)   ((range)->last)
+
+/* pcd_range_tree_insert/remove/iter_first/iter_next over the held byte ranges */
+INTERVAL_TREE_DEFINE(struct pcd_range, rb, loff_t, subtree_last, PCD_RANGE_START, PCD_RANGE_LAST, static, pcd_range_tree)
+
+/* Pick the locking mode of a device, FIFO and frame devices always use pcdev_lock */
+void pcd_lock_init(struct pcdev_private_data *dev_data) {
+
+    dev_data->lock_mode = (dev_data->fifo || dev_data->frame) ? PCD_LOCK_MUTEX : lock_mode;
+
+    /* A bigger device would keep preemption off for too long in the write section */
+    if ((dev_data->lock_mode == PCD_LOCK_SEQLOCK) && (dev_data->size > PCD_SEQ_SIZE_MAX))
+        dev_data->lock_mode = PCD_LOCK_MUTEX;
+    init_rwsem(&dev_data->pcdev_rwsem);
+    seqcount_init(&dev_data->pcdev_seq);
+    spin_lock_init(&dev_data->range_lock);
+    dev_data->range_tree = RB_ROOT_CACHED;
+    init_waitqueue_head(&dev_data->range_wq);
+}
+
+/* Describe the bytes an I/O touches, an empty I/O still locks the byte at pos */
+void pcd_range_init(struct pcd_range *range, loff_t pos, size_t count, bool write) {
+
+    range->start = pos;
+    range->last = pos + max_t(size_t, count, 1) - 1;
+    range->write = write;
+}
+
+/* Insert the range unless it overlaps a held range and one of the two is a writer */
+bool pcd_range_trylock(struct pcdev_private_data *dev_data, struct pcd_range *range) {
+
+    struct pcd_range *held;
+    bool locked = true;
+
+    spin_lock(&dev_data->range_lock);
+    for (held = pcd_range_tree_iter_first(&dev_data->range_tree, range->start, range->last); held;
+         held = pcd_range_tree_iter_next(held, range->start, range->last)) {
+        if (held->write || range->write) {
+            locked = false;
+            break;
+        }
+    }
+    if (locked)
+        pcd_range_tree_insert(range, &dev_data->range_tree);
+    spin_unlock(&dev_data->range_lock);
+
+    return locked;
+}
+
+/* Try the device lock of the configured mode without sleeping, false when it is taken */
+bool pcd_lock_try(struct pcdev_private_data *dev_data, struct pcd_range *range) {
+
+    if (dev_data->lock_mode == PCD_LOCK_RANGE)
+        return pcd_range_trylock(dev_data, range);
+
+    if (dev_data->lock_mode == PCD_LOCK_RWSEM)
+        return range->write ? down_write_trylock(&dev_data->pcdev_rwsem) : down_read_trylock(&dev_data->pcdev_rwsem);
+
+    /* The mutex mode, and the writers and large reads of the seqlock mode */
+    return mutex_trylock(&dev_data->pcdev_lock);
+}
+
+/* Take the device lock, only a contended lock reads the clock for the statistics */
+int pcd_lock(struct pcdev_private_data *dev_data, struct pcd_range *range, bool nowait) {
+
+    int ret;
+    u64 start;
+
+    if (pcd_lock_try(dev_data, range))
+        return 0;
+    if (nowait)
+        return -EAGAIN;
+
+    start = ktime_get_ns();
+    if (dev_data->lock_mode == PCD_LOCK_RANGE)
+        ret = wait_event_interruptible(dev_data->range_wq, pcd_range_trylock(dev_data, range));
+    else if (dev_data->lock_mode == PCD_LOCK_RWSEM)
+        /* There is no interruptible rwsem down in this kernel, killable is the closest */
+        ret = range->write ? down_write_killable(&dev_data->pcdev_rwsem) : down_read_killable(&dev_data->pcdev_rwsem);
+    else
+        ret = mutex_lock_interruptible(&dev_data->pcdev_lock);
+    pcd_stats_lock(dev_data->stats, start);
+
+    return ret ? -EINTR : 0;
+}
+
+void pcd_unlock(struct pcdev_private_data *dev_data, struct pcd_range *range) {
+
+    if (dev_data->lock_mode == PCD_LOCK_RANGE) {
+        spin_lock(&dev_data->range_lock);
+        pcd_range_tree_remove(range, &dev_data->range_tree);
+        spin_unlock(&dev_data->range_lock);
+        wake_up(&dev_data->range_wq);
+    } else if (dev_data->lock_mode != PCD_LOCK_RWSEM) {
+        mutex_unlock(&dev_data->pcdev_lock);
+    } else if (range->write) {
+        up_write(&dev_data->pcdev_rwsem);
+    } else {
+        up_read(&dev_data->pcdev_rwsem);
+    }
+}
+
+/* Copy count bytes at pos into a kernel buffer, never sleeps */
+void pcd_buffer_peek(struct pcdev_private_data *dev_data, void *dst, size_t count, loff_t pos) {
+
+    size_t done = 0, chunk;
+    unsigned long offset;
+    struct page *page;
+    void *kaddr;
+
+    while (done < count) {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - done);
+
+        page = pcd_buffer_page(dev_data, (pos + done) >> PAGE_SHIFT, false);
+        if (page) {
+            kaddr = kmap_atomic(page);
+            memcpy(dst + done, kaddr + offset, chunk);
+            kunmap_atomic(kaddr);
+        } else {
+            memset(dst + done, 0, chunk);
+        }
+
+        done += chunk;
+    }
+}
+
+/* Copy count bytes from a kernel buffer to pos, the pages must be allocated already, never sleeps */
+void pcd_buffer_poke(struct pcdev_private_data *dev_data, const void *src, size_t count, loff_t pos) {
+
+    size_t done = 0, chunk;
+    unsigned long offset;
+    void *kaddr;
+
+    while (done < count) {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - done);
+
+        kaddr = kmap_atomic(dev_data->pages[(pos + done) >> PAGE_SHIFT]);
+        memcpy(kaddr + offset, src + done, chunk);
+        kunmap_atomic(kaddr);
+
+        done += chunk;
+    }
+}
+
+/* Lockless read: snapshot the range into a bounce buffer, retrying while a writer races with us */
+ssize_t pcd_seq_read(struct pcdev_private_data *dev_data, struct iov_iter *to, size_t count, loff_t pos, bool nowait) {
+
+    unsigned int seq;
+    size_t copied;
+    char *bounce;
+    u64 start = 0;
+
+    if (!count)
+        return 0;
+
+    bounce = kmalloc(count, nowait ? GFP_NOWAIT : GFP_KERNEL);
+    if (!bounce)
+        return nowait ? -EAGAIN : -ENOMEM;
+
+    for (;;) {
+        seq = read_seqcount_begin(&dev_data->pcdev_seq);
+        pcd_buffer_peek(dev_data, bounce, count, pos);
+        if (!read_seqcount_retry(&dev_data->pcdev_seq, seq))
+            break;
+        /* A raced writer counts as contention, the time spent retrying as lock wait */
+        if (!start)
+            start = ktime_get_ns();
+    }
+    if (start)
+        pcd_stats_lock(dev_data->stats, start);
+
+    copied = copy_to_iter(bounce, count, to);
+    kfree(bounce);
+
+    return copied ? copied : -EFAULT;
+}
+
+/*
+ * Seqlock writer, caller holds pcdev_lock. Data and pages are brought in first, so the write section
+ * never sleeps, and the device is at most PCD_SEQ_SIZE_MAX bytes, so the section stays short.
+ */
+ssize_t pcd_seq_write(struct pcdev_private_data *dev_data, struct iov_iter *from, size_t count, loff_t pos, bool nowait) {
+
+    unsigned long index;
+    struct page *page;
+    size_t copied;
+    ssize_t ret;
+    char *bounce;
+
+    bounce = kmalloc(count, nowait ? GFP_NOWAIT : GFP_KERNEL);
+    if (!bounce)
+        return nowait ? -EAGAIN : -ENOMEM;
+
+    copied = copy_from_iter(bounce, count, from);
+    if (!copied) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    for (index = pos >> PAGE_SHIFT; index <= (pos + copied - 1) >> PAGE_SHIFT; index++) {
+        /* A nowait writer must not block in the page allocator */
+        page = pcd_buffer_page(dev_data, index, !nowait);
+        if (IS_ERR_OR_NULL(page)) {
+            iov_iter_revert(from, copied);
+            ret = page ? PTR_ERR(page) : -EAGAIN;
+            goto out;
+        }
+    }
+
+    /* A preempted writer would leave the readers spinning, so keep the section short and atomic */
+    preempt_disable();
+    write_seqcount_begin(&dev_data->pcdev_seq);
+    pcd_buffer_poke(dev_data, bounce, copied, pos);
+    write_seqcount_end(&dev_data->pcdev_seq);
+    preempt_enable();
+    ret = copied;
+
+out:
+    kfree(bounce);
+    return ret;
+}
+
+/* Set up the FIFO state of a device, the thresholds are kept inside the ring size */
+void pcd_fifo_init(struct pcdev_private_data *dev_data, bool fifo) {
+
+    dev_data->fifo = fifo;
+    dev_data->fifo_out = 0;
+    dev_data->fifo_len = 0;
+    dev_data->fifo_rd_threshold = clamp_t(unsigned int, fifo_rd_threshold, 1, dev_data->size);
+    dev_data->fifo_wr_threshold = clamp_t(unsigned int, fifo_wr_threshold, 1, dev_data->size);
+    init_waitqueue_head(&dev_data->fifo_rq);
+    init_waitqueue_head(&dev_data->fifo_wq);
+}
+
+/* Lockless snapshot of the fill level, only used for wait conditions and poll */
+unsigned long pcd_fifo_len(struct pcdev_private_data *dev_data) {
+
+    return READ_ONCE(dev_data->fifo_len);
+}
+
+/* Copy count bytes between the iterator and the ring from ring position pos, wrapping at the end */
+ssize_t pcd_fifo_copy(struct pcdev_private_data *dev_data, struct iov_iter *iter, size_t count, unsigned long pos, bool write, bool nowait) {
+
+    size_t done = 0, chunk;
+    ssize_t ret;
+
+    while (done < count) {
+        pos %= dev_data->size;
+        chunk = min_t(size_t, count - done, dev_data->size - pos);
+
+        if (write)
+            ret = pcd_buffer_write(dev_data, iter, chunk, pos, nowait);
+        else if (iov_iter_is_pipe(iter))
+            ret = pcd_fifo_copy_to_pipe(dev_data, iter, chunk, pos);
+        else
+            ret = pcd_buffer_read(dev_data, iter, chunk, pos);
+        if (ret < 0)
+            return done ? done : ret;
+
+        done += ret;
+        pos += ret;
+        if ((size_t)ret < chunk)
+            break;
+    }
+
+    return done;
+}
+
+/* The ring reuses its pages, so a pipe gets copies of them instead of references */
+ssize_t pcd_fifo_copy_to_pipe(struct pcdev_private_data *dev_data, struct iov_iter *to, size_t count, unsigned long pos) {
+
+    size_t done = 0, chunk, copied;
+    unsigned long offset;
+    struct page *page;
+
+    while (done < count) {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - done);
+
+        page = pcd_buffer_page(dev_data, (pos + done) >> PAGE_SHIFT, false);
+        if (page) {
+            copied = copy_to_iter(kmap(page) + offset, chunk, to);
+            kunmap(page);
+        } else {
+            copied = iov_iter_zero(chunk, to);
+        }
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    return (done || !count) ? done : -EFAULT;
+}
+
+/* Blocking readers wait for the read threshold, non-blocking readers take whatever is there */
+ssize_t pcd_fifo_read(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *to) {
+
+    bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    size_t count = iov_iter_count(to);
+    unsigned long len, room;
+    ssize_t ret;
+
+    if (!count)
+        return 0;
+
+    for (;;) {
+        if (iocb->ki_flags & IOCB_NOWAIT) {
+            if (!mutex_trylock(&dev_data->pcdev_lock))
+                return -EAGAIN;
+        } else if (pcd_stats_mutex_lock(dev_data->stats, &dev_data->pcdev_lock)) {
+            return -EINTR;
+        }
+
+        len = dev_data->fifo_len;
+        if ((len >= dev_data->fifo_rd_threshold) || (len && nonblock))
+            break;
+        mutex_unlock(&dev_data->pcdev_lock);
+
+        if (nonblock)
+            return -EAGAIN;
+
+        if (wait_event_interruptible(dev_data->fifo_rq, pcd_fifo_len(dev_data) >= dev_data->fifo_rd_threshold))
+            return -ERESTARTSYS;
+    }
+
+    ret = pcd_fifo_copy(dev_data, to, min_t(size_t, count, len), dev_data->fifo_out, false, false);
+    if (ret > 0) {
+        dev_data->fifo_out = (dev_data->fifo_out + ret) % dev_data->size;
+        WRITE_ONCE(dev_data->fifo_len, len - ret);
+    }
+    mutex_unlock(&dev_data->pcdev_lock);
+
+    /* Only wake up the writers when the free room crosses their threshold */
+    room = dev_data->size - len;
+    if ((ret > 0) && (room < dev_data->fifo_wr_threshold) && (room + ret >= dev_data->fifo_wr_threshold))
+        wake_up_interruptible_poll(&dev_data->fifo_wq, EPOLLOUT | EPOLLWRNORM);
+
+    return ret;
+}
+
+/* Blocking writers write everything, sleeping until the write threshold is free whenever the ring is full */
+ssize_t pcd_fifo_write(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *from) {
+
+    bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    size_t count = iov_iter_count(from), done = 0, chunk;
+    unsigned long len, room;
+    ssize_t ret = 0;
+
+    while (done < count) {
+        if (iocb->ki_flags & IOCB_NOWAIT) {
+            if (!mutex_trylock(&dev_data->pcdev_lock)) {
+                ret = -EAGAIN;
+                break;
+            }
+        } else if (pcd_stats_mutex_lock(dev_data->stats, &dev_data->pcdev_lock)) {
+            ret = -EINTR;
+            break;
+        }
+
+        len = dev_data->fifo_len;
+        room = dev_data->size - len;
+        if (!room) {
+            mutex_unlock(&dev_data->pcdev_lock);
+
+            if (nonblock) {
+                ret = -EAGAIN;
+                break;
+            }
+
+            if (wait_event_interruptible(dev_data->fifo_wq,
+                    dev_data->size - pcd_fifo_len(dev_data) >= dev_data->fifo_wr_threshold)) {
+                ret = -ERESTARTSYS;
+                break;
+            }
+            continue;
+        }
+
+        chunk = min_t(size_t, count - done, room);
+        ret = pcd_fifo_copy(dev_data, from, chunk, dev_data->fifo_out + len, true, iocb->ki_flags & IOCB_NOWAIT);
+        if (ret > 0)
+            WRITE_ONCE(dev_data->fifo_len, len + ret);
+        mutex_unlock(&dev_data->pcdev_lock);
+
+        if (ret <= 0)
+            break;
+
+        /* Only wake up the readers when the fill level crosses their threshold */
+        if ((len < dev_data->fifo_rd_threshold) && (len + ret >= dev_data->fifo_rd_threshold))
+            wake_up_interruptible_poll(&dev_data->fifo_rq, EPOLLIN | EPOLLRDNORM);
+
+        done += ret;
+        if ((size_t)ret < chunk)
+            break;
+    }
+
+    return done ? done : ret;
+}
+
+/* Frames retired by the last reader go back to the pool once no RCU reader can still see them */
+void pcd_frame_rcu(struct rcu_head *head) {
+
+    struct pcd_frame *frame = container_of(head, struct pcd_frame, rcu);
+
+    llist_add(&frame->node, &frame->dev_data->frame_pool);
+}
+
+void pcd_frame_put(struct pcd_frame *frame) {
+
+    if (refcount_dec_and_test(&frame->ref))
+        call_rcu(&frame->rcu, pcd_frame_rcu);
+}
+
+/* Take a back buffer from the pool or allocate one, caller holds pcdev_lock (single pool consumer) */
+struct pcd_frame *pcd_frame_alloc(struct pcdev_private_data *dev_data, size_t size, gfp_t gfp) {
+
+    struct llist_node *node;
+    struct pcd_frame *frame;
+
+    while ((node = llist_del_first(&dev_data->frame_pool))) {
+        frame = llist_entry(node, struct pcd_frame, node);
+        if (frame->size == size)
+            goto found;
+        /* Left over from before a resize */
+        kfree(frame);
+    }
+
+    frame = kmalloc(struct_size(frame, data, size), gfp);
+    if (!frame)
+        return NULL;
+    frame->dev_data = dev_data;
+    frame->size = size;
+
+found:
+    refcount_set(&frame->ref, 1);
+    return frame;
+}
+
+/* Publish a zeroed first frame, the published frame holds one reference of its own */
+int pcd_frame_init(struct pcdev_private_data *dev_data) {
+
+    struct pcd_frame *frame;
+
+    if (!dev_data->frame)
+        return 0;
+
+    frame = pcd_frame_alloc(dev_data, dev_data->size, GFP_KERNEL);
+    if (!frame)
+        return -ENOMEM;
+    memset(frame->data, 0, frame->size);
+    rcu_assign_pointer(dev_data->frame_front, frame);
+
+    return 0;
+}
+
+/* Free the published frame and the pool, no reader may be left */
+void pcd_frame_free(struct pcdev_private_data *dev_data) {
+
+    struct llist_node *node;
+    struct pcd_frame *frame, *next;
+
+    if (!dev_data->frame)
+        return;
+
+    /* Frames released by the last readers are still on their way to the pool */
+    rcu_barrier();
+
+    kfree(rcu_dereference_protected(dev_data->frame_front, 1));
+    RCU_INIT_POINTER(dev_data->frame_front, NULL);
+    node = llist_del_all(&dev_data->frame_pool);
+    llist_for_each_entry_safe(frame, next, node, node)
+        kfree(frame);
+}
+
+/* Reference the published frame, retrying if a writer retired it meanwhile */
+struct pcd_frame *pcd_frame_get(struct pcdev_private_data *dev_data) {
+
+    struct pcd_frame *frame;
+
+    rcu_read_lock();
+    do {
+        frame = rcu_dereference(dev_data->frame_front);
+    } while (!refcount_inc_not_zero(&frame->ref));
+    rcu_read_unlock();
+
+    return frame;
+}
+
+/* Readers never take the writer's lock, they copy out of the frame they referenced */
+ssize_t pcd_frame_read(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *to) {
+
+    size_t count = iov_iter_count(to), copied;
+    loff_t pos = iocb->ki_pos;
+    struct pcd_frame *frame;
+
+    frame = pcd_frame_get(dev_data);
+
+    if (pos >= frame->size)
+        count = 0;
+    else if ((pos + count) > frame->size)
+        count = frame->size - pos;
+
+    copied = copy_to_iter(frame->data + pos, count, to);
+    pcd_frame_put(frame);
+
+    if (count && !copied)
+        return -EFAULT;
+
+    iocb->ki_pos += copied;
+    return copied;
+}
+
+/* Fill a back buffer and swap it in, readers see either the old or the new frame */
+ssize_t pcd_frame_write(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *from) {
+
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    size_t count = iov_iter_count(from), copied;
+    loff_t pos = iocb->ki_pos;
+    struct pcd_frame *front, *back;
+    ssize_t ret;
+
+    if (nowait) {
+        if (!mutex_trylock(&dev_data->pcdev_lock))
+            return -EAGAIN;
+    } else if (pcd_stats_mutex_lock(dev_data->stats, &dev_data->pcdev_lock)) {
+        return -EINTR;
+    }
+
+    front = rcu_dereference_protected(dev_data->frame_front, lockdep_is_held(&dev_data->pcdev_lock));
+
+    /* Ajust the count argument, pwrite may start beyond the end of the frame */
+    if (pos >= front->size)
+        count = 0;
+    else if ((pos + count) > front->size)
+        count = front->size - pos;
+
+    if (!count) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    back = pcd_frame_alloc(dev_data, front->size, nowait ? GFP_NOWAIT : GFP_KERNEL);
+    if (!back) {
+        ret = nowait ? -EAGAIN : -ENOMEM;
+        goto out;
+    }
+
+    copied = copy_from_iter(back->data + pos, count, from);
+    if (!copied) {
+        pcd_frame_put(back);
+        ret = -EFAULT;
+        goto out;
+    }
+
+    /* Whatever the write didn't cover keeps the content of the previous frame */
+    if (pos)
+        memcpy(back->data, front->data, pos);
+    if (pos + copied < front->size)
+        memcpy(back->data + pos + copied, front->data + pos + copied, front->size - pos - copied);
+
+    rcu_assign_pointer(dev_data->frame_front, back);
+    pcd_frame_put(front);
+
+    iocb->ki_pos += copied;
+    ret = copied;
+
+out:
+    mutex_unlock(&dev_data->pcdev_lock);
+    return ret;
+}
+
 int check_permission(int permission, int access_mode){
 
     if (permission == RDWR)
@@ -133,8 +1009,24 @@ int pcd_open(struct inode *inode, struct file *filp) {
     /* Supply device private data to other method of the driver */
     filp->private_data = pcdev_data;
 
+    /* Reads and writes honour IOCB_NOWAIT, so preadv2/pwritev2 may use RWF_NOWAIT */
+    filp->f_mode |= FMODE_NOWAIT;
+
+    /* A FIFO has no file position, lseek and pread/pwrite fail with -ESPIPE */
+    if (pcdev_data->fifo)
+        stream_open(inode, filp);
+
     /* Check permission */
     ret = check_permission(pcdev_data->permission, filp->f_mode);
+
+    /* The buffer is allocated by the first opener and stays until the idle release */
+    if (!ret) {
+        if (mutex_lock_interruptible(&pcdev_data->pcdev_lock))
+            return -ERESTARTSYS;
+        ret = pcd_buffer_get(pcdev_data);
+        mutex_unlock(&pcdev_data->pcdev_lock);
+    }
+
     if (!ret)
         pr_info("Open was successful\n");
     else
@@ -143,63 +1035,138 @@ int pcd_open(struct inode *inode, struct file *filp) {
     return ret;
 }
 
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t *f_pos) {
+/* Read/write of a device, also used by the batch ioctl where the file belongs to another device */
+ssize_t pcd_dev_read(struct pcdev_private_data *pcdev_data, struct kiocb *iocb, struct iov_iter *to) {
 
     int max_size;
-    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+    ssize_t ret;
+    size_t count = iov_iter_count(to);
+    size_t requested = count;
+    loff_t pos = iocb->ki_pos;
+    /* Only read the clock when somebody listens to the tracepoint */
+    u64 start = trace_pcd_read_enabled() ? ktime_get_ns() : 0;
+    struct pcd_range range;
+
+    /* A FIFO device has its own blocking rules */
+    if (pcdev_data->fifo) {
+        ret = pcd_fifo_read(pcdev_data, iocb, to);
+        goto out_trace;
+    }
+
+    if (pcdev_data->frame) {
+        ret = pcd_frame_read(pcdev_data, iocb, to);
+        goto out_trace;
+    }
+
+    /* The size of a device never changes, so the count is adjusted before locking */
     max_size = pcdev_data->size;
 
-    if (mutex_lock_interruptible(&pcdev_data->pcdev_lock))
-        return -EINTR;
+    /* Ajust the count argument, pread may start beyond the end of the device */
+    if (pos >= max_size)
+        count = 0;
+    else if ((pos + count) > max_size)
+        count = max_size - pos;
 
-    pr_info("Read requested for %zu bytes \n",count);
-    pr_info("Current file position = %lld\n",*f_pos);
+    /* Reads of a seqlock device take no lock at all */
+    if (pcdev_data->lock_mode == PCD_LOCK_SEQLOCK) {
+        ret = pcd_seq_read(pcdev_data, to, count, pos, iocb->ki_flags & IOCB_NOWAIT);
+        if (ret > 0)
+            iocb->ki_pos += ret;
+        goto out_trace;
+    }
 
-    /* Ajust the count argument */
-    if ((*f_pos + count) > max_size)
-        count = max_size - *f_pos;
+    /* RWF_NOWAIT: give up instead of sleeping on a busy device */
+    pcd_range_init(&range, pos, count, false);
+    ret = pcd_lock(pcdev_data, &range, iocb->ki_flags & IOCB_NOWAIT);
+    if (ret)
+        goto out_trace;
+
+    ret = pcd_buffer_read(pcdev_data, to, count, pos);
+    if (ret < 0)
+        goto out;
 
-    if (copy_to_user(buff, pcdev_data->buffer, count))
-        return -EFAULT;
-    
     /* Update current file position */
-    *f_pos += count;
-    pr_info("Number of bytes successfully read = %zu\n", count);
-    pr_info("Updated file position = %lld\n",*f_pos);
+    iocb->ki_pos += ret;
 
-    mutex_unlock(&pcdev_data->pcdev_lock);
-    return count;
+out:
+    pcd_unlock(pcdev_data, &range);
+out_trace:
+    pcd_stats_io(pcdev_data->stats, false, requested, ret);
+    trace_pcd_read(pcdev_data->cdev.dev, pos, requested, ret,
+                   start ? ktime_get_ns() - start : 0);
+    return ret;
+}
+
+ssize_t pcd_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+
+    return pcd_dev_read(iocb->ki_filp->private_data, iocb, to);
 }
 
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos) {
+ssize_t pcd_dev_write(struct pcdev_private_data *pcdev_data, struct kiocb *iocb, struct iov_iter *from) {
 
     int max_size;
-    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
-    max_size = pcdev_data->size;
+    ssize_t ret;
+    size_t count = iov_iter_count(from);
+    size_t requested = count;
+    loff_t pos = iocb->ki_pos;
+    /* Only read the clock when somebody listens to the tracepoint */
+    u64 start = trace_pcd_write_enabled() ? ktime_get_ns() : 0;
+    struct pcd_range range;
 
-    if (mutex_lock_interruptible(&pcdev_data->pcdev_lock))
-        return -EINTR;
+    /* A FIFO device has its own blocking rules */
+    if (pcdev_data->fifo) {
+        ret = pcd_fifo_write(pcdev_data, iocb, from);
+        goto out_trace;
+    }
 
-    pr_info("Write requested %zu bytes \n",count);
-    pr_info("Current file position = %lld\n",*f_pos);
+    if (pcdev_data->frame) {
+        ret = pcd_frame_write(pcdev_data, iocb, from);
+        goto out_trace;
+    }
 
-    /* Ajust the count argument */
-    if ((*f_pos + count) > max_size)
-        count = max_size - *f_pos;
+    /* The size of a device never changes, so the count is adjusted before locking */
+    max_size = pcdev_data->size;
 
-    if (!count)
-        return -ENOMEM;
+    /* Ajust the count argument, pwrite may start beyond the end of the device */
+    if (pos >= max_size)
+        count = 0;
+    else if ((pos + count) > max_size)
+        count = max_size - pos;
 
-    if (copy_from_user(pcdev_data->buffer, buff, count))
-        return -EFAULT;
+    if (!count) {
+        ret = -ENOMEM;
+        goto out_trace;
+    }
+
+    /* RWF_NOWAIT: give up instead of sleeping on a busy device */
+    pcd_range_init(&range, pos, count, true);
+    ret = pcd_lock(pcdev_data, &range, iocb->ki_flags & IOCB_NOWAIT);
+    if (ret)
+        goto out_trace;
+
+    /* Seqlock writers must not sleep inside the write section, they stage the data first */
+    if (pcdev_data->lock_mode == PCD_LOCK_SEQLOCK)
+        ret = pcd_seq_write(pcdev_data, from, count, pos, iocb->ki_flags & IOCB_NOWAIT);
+    else
+        ret = pcd_buffer_write(pcdev_data, from, count, pos, iocb->ki_flags & IOCB_NOWAIT);
+    if (ret < 0)
+        goto out;
 
     /* Update current file position */
-    *f_pos += count;
-    pr_info("Number of bytes successfully written = %zu\n", count);
-    pr_info("Updated file position = %lld\n",*f_pos);
+    iocb->ki_pos += ret;
 
-    mutex_unlock(&pcdev_data->pcdev_lock);
-    return count;
+out:
+    pcd_unlock(pcdev_data, &range);
+out_trace:
+    pcd_stats_io(pcdev_data->stats, true, requested, ret);
+    trace_pcd_write(pcdev_data->cdev.dev, pos, requested, ret,
+                    start ? ktime_get_ns() - start : 0);
+    return ret;
+}
+
+ssize_t pcd_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+
+    return pcd_dev_write(iocb->ki_filp->private_data, iocb, from);
 }
 
 loff_t pcd_lseek(struct file *filp, loff_t offset, int whence) {
@@ -231,12 +1198,192 @@ loff_t pcd_lseek(struct file *filp, loff_t offset, int whence) {
             return -EINVAL;
     }
 
-    pr_info("New value of the file position = %lld\n",filp->f_pos);
+    trace_pcd_lseek(file_inode(filp)->i_rdev, offset, whence, filp->f_pos);
     return filp->f_pos;
 
 }
 
+int pcd_mmap(struct file *filp, struct vm_area_struct *vma) {
+
+    unsigned long i;
+    struct page *page;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+
+    /* The content of a FIFO or a frame device moves, there is nothing stable to map */
+    if (pcdev_data->fifo || pcdev_data->frame)
+        return -ENODEV;
+
+    /*
+     * Only shared mappings make sense, private ones would hide the device content. Test VM_MAYSHARE:
+     * mmap() clears VM_SHARED of a MAP_SHARED mapping of a file opened read only
+     */
+    if (!(vma->vm_flags & VM_MAYSHARE))
+        return -EINVAL;
+
+    /* A write only page can't be expressed by the MMU, so write only devices are never mapped */
+    if (pcdev_data->permission == WRONLY)
+        return -EPERM;
+
+    /* Read only device: refuse writable mappings and forbid a later mprotect(PROT_WRITE) */
+    if (pcdev_data->permission == RDONLY) {
+        if (vma->vm_flags & VM_WRITE)
+            return -EPERM;
+        vma->vm_flags &= ~VM_MAYWRITE;
+    }
+
+    /* The mapping must stay inside the (page aligned) device buffer */
+    if ((vma->vm_pgoff >= pcdev_data->nr_pages) || (vma_pages(vma) > pcdev_data->nr_pages - vma->vm_pgoff))
+        return -EINVAL;
+
+    /* Populate the mapped range up front, so no fault handler is needed */
+    for (i = vma->vm_pgoff; i < vma->vm_pgoff + vma_pages(vma); i++) {
+        page = pcd_buffer_page(pcdev_data, i, true);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+    }
+
+    /* The mapping holds its own references on the pages */
+    return vm_map_pages(vma, pcdev_data->pages, pcdev_data->nr_pages);
+}
+
+/* A FIFO reports its fill thresholds, a random access device is always ready */
+__poll_t pcd_poll(struct file *filp, poll_table *wait) {
+
+    unsigned long len;
+    __poll_t mask = 0;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+
+    if (!pcdev_data->fifo)
+        return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &pcdev_data->fifo_rq, wait);
+    poll_wait(filp, &pcdev_data->fifo_wq, wait);
+
+    len = pcd_fifo_len(pcdev_data);
+    if (len >= pcdev_data->fifo_rd_threshold)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (pcdev_data->size - len >= pcdev_data->fifo_wr_threshold)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+
+    return mask;
+}
+
+long pcd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+
+    switch (cmd) {
+        case PCD_IOC_BATCH:
+            return pcd_batch(filp, (struct pcd_batch __user *)arg);
+        default:
+            return -ENOTTY;
+    }
+}
+
+#ifdef CONFIG_COMPAT
+/* 32-bit callers, struct pcd_batch has the same layout there, only the pointer argument is converted */
+long pcd_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+
+    return pcd_ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
+/*
+ * The entry's file must be a pcdev opened for the direction, like read()/write() on it would need.
+ * Its open() already passed the inode permission and the device's RDONLY/WRONLY check.
+ */
+int pcd_batch_check(struct file *file, struct pcd_batch_entry *entry) {
+
+    fmode_t mode;
+
+    if ((entry->direction > PCD_BATCH_WRITE) || (entry->offset > LLONG_MAX))
+        return -EINVAL;
+
+    if (file->f_op != &pcd_fops)
+        return -EINVAL;
+
+    mode = (entry->direction == PCD_BATCH_WRITE) ? FMODE_WRITE : FMODE_READ;
+    if (!(file->f_mode & mode))
+        return -EBADF;
+
+    return 0;
+}
+
+/* Run one entry through the same path as read()/write() of its file */
+ssize_t pcd_batch_io(struct file *file, struct pcd_batch_entry *entry) {
+
+    int ret;
+    struct iovec iov;
+    struct iov_iter iter;
+    struct kiocb kiocb;
+    struct pcdev_private_data *dev_data = file->private_data;
+    bool write = entry->direction == PCD_BATCH_WRITE;
+
+    ret = import_single_range(write ? WRITE : READ, u64_to_user_ptr(entry->buf),
+                              min_t(u64, entry->length, MAX_RW_COUNT), &iov, &iter);
+    if (ret)
+        return ret;
+
+    init_sync_kiocb(&kiocb, file);
+    kiocb.ki_pos = entry->offset;
+
+    return write ? pcd_dev_write(dev_data, &kiocb, &iter) : pcd_dev_read(dev_data, &kiocb, &iter);
+}
+
+/* Run a vector of transfers on open pcdev files in one syscall, every entry gets its own result */
+long pcd_batch(struct file *filp, struct pcd_batch __user *ubatch) {
+
+    u32 i;
+    long ret = 0;
+    struct fd f;
+    struct pcd_batch batch;
+    struct pcd_batch_entry *entries, *entry;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+
+    if (!batch.nr || (batch.nr > PCD_BATCH_MAX))
+        return -EINVAL;
+
+    entries = memdup_user(u64_to_user_ptr(batch.entries), array_size(batch.nr, sizeof(*entries)));
+    if (IS_ERR(entries))
+        return PTR_ERR(entries);
+
+    for (i = 0; i < batch.nr; i++) {
+        entry = &entries[i];
+
+        /* The rest of the batch is not run once a signal is pending */
+        if (signal_pending(current)) {
+            entry->result = -EINTR;
+            continue;
+        }
+
+        /* The open file also holds the device buffer, nothing else has to be pinned */
+        f = fdget(entry->fd);
+        if (!f.file) {
+            entry->result = -EBADF;
+            continue;
+        }
+
+        entry->result = pcd_batch_check(f.file, entry);
+        if (!entry->result)
+            entry->result = pcd_batch_io(f.file, entry);
+        fdput(f);
+    }
+
+    if (copy_to_user(u64_to_user_ptr(batch.entries), entries, array_size(batch.nr, sizeof(*entries))))
+        ret = -EFAULT;
+
+    kfree(entries);
+    return ret;
+}
+
 int pcd_release(struct inode *inode, struct file *filp) {
+
+    struct pcdev_private_data *pcdev_data = filp->private_data;
+
+    mutex_lock(&pcdev_data->pcdev_lock);
+    pcd_buffer_put(pcdev_data);
+    mutex_unlock(&pcdev_data->pcdev_lock);
+
     pr_info("Released successful\n");
     return 0;
 }
@@ -245,10 +1392,37 @@ static int __init char_device_driver_init(void) {
 
     int ret, i;
 
+    if (lock_mode > PCD_LOCK_RANGE) {
+        pr_err("Invalid lock_mode %u\n", lock_mode);
+        return -EINVAL;
+    }
+
+    if (fifo_mask & frame_mask) {
+        pr_err("A device can't be in FIFO and frame mode at once\n");
+        return -EINVAL;
+    }
+
+    if (!nr_devices || nr_devices > PCD_MAX_DEVICES) {
+        pr_err("nr_devices must be 1 - %d\n", PCD_MAX_DEVICES);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < nr_devices; i++) {
+        if (perms[i] > RDWR || sizes[i] > INT_MAX) {
+            pr_err("Invalid size %u or permission %u of pcdev-%d\n", sizes[i], perms[i], i + 1);
+            return -EINVAL;
+        }
+    }
+
+    pcdrv_data.pcdev_data = kcalloc(nr_devices, sizeof(*pcdrv_data.pcdev_data), GFP_KERNEL);
+    if (!pcdrv_data.pcdev_data)
+        return -ENOMEM;
+    pcdrv_data.total_device = nr_devices;
+
     /* Dynamically allocate a device number <one device> */
-    ret = alloc_chrdev_region(&pcdrv_data.device_number, 0, NO_OF_DEVICES, DEV_NAME);
+    ret = alloc_chrdev_region(&pcdrv_data.device_number, 0, nr_devices, DEV_NAME);
     if (ret < 0)
-        goto error_out;
+        goto free_devices;
 
     /* Create class and device files </sys/class/...> */
     pcdrv_data.class_pcd = class_create(THIS_MODULE, CLASS_NAME);
@@ -257,16 +1431,42 @@ static int __init char_device_driver_init(void) {
         goto unregister_char_dd;
     }
 
-    for (i = 0; i < NO_OF_DEVICES; i++) {
+    /* Statistics are optional, the driver works on without debugfs */
+    pcdrv_data.debugfs_root = debugfs_create_dir(CLASS_NAME, NULL);
+
+    for (i = 0; i < nr_devices; i++) {
         pr_info("Device number <Major>:<Minor> = %d:%d\n", MAJOR(pcdrv_data.device_number + i), \
                                                            MINOR(pcdrv_data.device_number + i));
 
+        /* Zero entries, and devices past the end of the arrays, get the defaults */
+        pcdrv_data.pcdev_data[i].size = sizes[i] ? sizes[i] : MEM_SIZE_PCD;
+        pcdrv_data.pcdev_data[i].permission = perms[i] ? perms[i] : RDWR;
+        snprintf(pcdrv_data.pcdev_data[i].serial_number, sizeof(pcdrv_data.pcdev_data[i].serial_number), "PCD_DEV%d", i + 1);
+
         /* Initialize mutex for each device */
         mutex_init(&pcdrv_data.pcdev_data[i].pcdev_lock);
+        INIT_DELAYED_WORK(&pcdrv_data.pcdev_data[i].idle_work, pcd_idle_work);
 
         /* Make a character device registration with the VFS */
         cdev_init(&pcdrv_data.pcdev_data[i].cdev, &pcd_fops);
         pcdrv_data.pcdev_data[i].cdev.owner = THIS_MODULE;
+
+        /* After cdev_init(), the unwind below runs cdev_del() on this device too */
+        pcdrv_data.pcdev_data[i].stats = pcd_stats_alloc();
+        if (!pcdrv_data.pcdev_data[i].stats) {
+            ret = -ENOMEM;
+            goto cdev_del;
+        }
+
+        /* Nothing is allocated here, the first open allocates the buffer */
+        pcd_fifo_init(&pcdrv_data.pcdev_data[i], fifo_mask & BIT(i));
+
+        pcdrv_data.pcdev_data[i].frame = frame_mask & BIT(i);
+        init_llist_head(&pcdrv_data.pcdev_data[i].frame_pool);
+        RCU_INIT_POINTER(pcdrv_data.pcdev_data[i].frame_front, NULL);
+
+        pcd_lock_init(&pcdrv_data.pcdev_data[i]);
+
         ret = cdev_add(&pcdrv_data.pcdev_data[i].cdev, pcdrv_data.device_number + i, 1);
         if (ret < 0)
             goto cdev_del;
@@ -276,6 +1476,9 @@ static int __init char_device_driver_init(void) {
             ret = PTR_ERR(pcdrv_data.device_pcd);
             goto class_del;
         }
+
+        pcdrv_data.pcdev_data[i].debugfs = debugfs_create_dir(dev_name(pcdrv_data.device_pcd), pcdrv_data.debugfs_root);
+        debugfs_create_file("stats", S_IRUGO, pcdrv_data.pcdev_data[i].debugfs, pcdrv_data.pcdev_data[i].stats, &pcd_stats_fops);
     }
 
     pr_info("Module init was successful\n");
@@ -284,14 +1487,19 @@ static int __init char_device_driver_init(void) {
 
 cdev_del:
 class_del:
+    debugfs_remove_recursive(pcdrv_data.debugfs_root);
     for (; i >= 0; i--) {
         device_destroy(pcdrv_data.class_pcd, pcdrv_data.device_number + i);
         cdev_del(&pcdrv_data.pcdev_data[i].cdev);
+        pcd_frame_free(&pcdrv_data.pcdev_data[i]);
+        pcd_buffer_free(&pcdrv_data.pcdev_data[i]);
+        free_percpu(pcdrv_data.pcdev_data[i].stats);
     }
     class_destroy(pcdrv_data.class_pcd);
 unregister_char_dd:
-    unregister_chrdev_region(pcdrv_data.device_number, NO_OF_DEVICES);
-error_out:
+    unregister_chrdev_region(pcdrv_data.device_number, nr_devices);
+free_devices:
+    kfree(pcdrv_data.pcdev_data);
     return ret;
 
 }
@@ -299,12 +1507,18 @@ error_out:
 static void __exit char_device_driver_exit(void) {
     int i;
 
-    for (i = 0; i < NO_OF_DEVICES; i++) {
+    debugfs_remove_recursive(pcdrv_data.debugfs_root);
+    for (i = 0; i < nr_devices; i++) {
         device_destroy(pcdrv_data.class_pcd, pcdrv_data.device_number + i);
         cdev_del(&pcdrv_data.pcdev_data[i].cdev);
+        cancel_delayed_work_sync(&pcdrv_data.pcdev_data[i].idle_work);
+        pcd_frame_free(&pcdrv_data.pcdev_data[i]);
+        pcd_buffer_free(&pcdrv_data.pcdev_data[i]);
+        free_percpu(pcdrv_data.pcdev_data[i].stats);
     }
     class_destroy(pcdrv_data.class_pcd);
-    unregister_chrdev_region(pcdrv_data.device_number, NO_OF_DEVICES);
+    unregister_chrdev_region(pcdrv_data.device_number, nr_devices);
+    kfree(pcdrv_data.pcdev_data);
 
     pr_info("Unload module\n");
 }
@@ -0,0 +1,570 @@
+/*
+ * @brief: Stress and contention harness for the pcd devices (/dev/pcdev-N).
+ *         Threads run a mix of pread/pwrite/lseek+read against every device at once.
+ *         Every write stores self describing blocks (writer, sequence, pattern), so a
+ *         reader can tell a torn or corrupted block from a whole one.
+ *         Build: gcc -O2 -Wall -pthread -o pcd_stress pcd_stress.c
+ * @author: NghiaPham
+ * @date: 2020/12/20
+ * @version: v0.1
+ *
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <glob.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define MAX_DEVICES     32
+#define MAX_CPUS        64
+#define NR_BUCKETS      40          /* Bucket N holds latencies in [2^N, 2^(N+1)) ns */
+#define MAX_REPORTS     10          /* Integrity failures printed per thread */
+#define BLOCK_MAGIC     0x50434442u /* "PCDB" */
+#define FILL_WRITER     0xffff      /* Writer id of the blocks written before the threads start */
+#define DEFAULT_OPS     100000
+
+enum op_type {
+    OP_READ,
+    OP_WRITE,
+    OP_SEEK,
+    NR_OPS,
+};
+
+/* Head of every block, the rest of the block is a pattern derived from writer and seq */
+struct block_hdr {
+    uint32_t magic;
+    uint16_t writer;
+    uint16_t len;
+    uint64_t seq;
+};
+
+struct stress_config {
+    const char *devices[MAX_DEVICES];
+    int nr_devices;
+    int threads;                    /* Threads per device */
+    int ratio[NR_OPS];              /* Relative weight of every operation */
+    long ops;
+    int seconds;
+    long block;
+    long max_blocks;
+    int cpus[MAX_CPUS];
+    int nr_cpus;
+    int histogram;
+    unsigned int seed;
+};
+
+struct device_info {
+    const char *path;
+    int can_read;
+    int can_write;
+    long nr_blocks;
+};
+
+struct thread_ctx {
+    const struct stress_config *cfg;
+    const struct device_info *dev;
+    int id;
+    int cpu;
+    int started;
+    pthread_t thread;
+    long ops[NR_OPS];
+    long errors;
+    long short_io;
+    long corrupt;
+    uint64_t hist[NR_OPS][NR_BUCKETS];
+    uint64_t max_ns[NR_OPS];
+};
+
+static volatile int stop;
+
+static const char *op_name[NR_OPS] = { "read", "write", "seek" };
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t xorshift64(uint64_t *state) {
+
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/* The payload of a block only depends on its header, so any reader can recompute it */
+static void block_fill(char *blk, long len, uint16_t writer, uint64_t seq) {
+
+    struct block_hdr hdr = { .magic = BLOCK_MAGIC, .writer = writer, .len = len, .seq = seq };
+    uint64_t state = ((uint64_t)writer << 48) ^ seq ^ 0x9e3779b97f4a7c15ull, v;
+    long i;
+
+    memcpy(blk, &hdr, sizeof(hdr));
+    for (i = sizeof(hdr); i < len; i += sizeof(v)) {
+        v = xorshift64(&state);
+        memcpy(blk + i, &v, (len - i) < (long)sizeof(v) ? (size_t)(len - i) : sizeof(v));
+    }
+}
+
+/* A block is good if it is exactly what its header claims to be */
+static int block_check(const char *blk, long len, char *scratch) {
+
+    struct block_hdr hdr;
+
+    memcpy(&hdr, blk, sizeof(hdr));
+    if (hdr.magic != BLOCK_MAGIC || hdr.len != len)
+        return -1;
+
+    block_fill(scratch, len, hdr.writer, hdr.seq);
+    return memcmp(blk, scratch, len) ? -1 : 0;
+}
+
+static void record_latency(struct thread_ctx *ctx, enum op_type op, uint64_t ns) {
+
+    int b = 0;
+
+    while (b < NR_BUCKETS - 1 && (ns >> (b + 1)))
+        b++;
+    ctx->hist[op][b]++;
+    ctx->ops[op]++;
+    if (ns > ctx->max_ns[op])
+        ctx->max_ns[op] = ns;
+}
+
+/* Upper bound of the bucket holding the p-th sample */
+static uint64_t hist_percentile(const uint64_t *hist, long total, double p) {
+
+    uint64_t seen = 0;
+    int b;
+
+    if (!total)
+        return 0;
+    for (b = 0; b < NR_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= (uint64_t)(p * total + 0.5) && seen)
+            return 2ull << b;
+    }
+    return 2ull << (NR_BUCKETS - 1);
+}
+
+static void verify_blocks(struct thread_ctx *ctx, const char *buf, long nr, long first_block, char *scratch) {
+
+    long i, len = ctx->cfg->block;
+
+    for (i = 0; i < nr; i++) {
+        if (!block_check(buf + i * len, len, scratch))
+            continue;
+        if (ctx->corrupt++ < MAX_REPORTS)
+            fprintf(stderr, "%s: thread %d: corrupt block at offset %ld\n", ctx->dev->path, ctx->id,
+                    (first_block + i) * len);
+    }
+}
+
+static enum op_type pick_op(const struct thread_ctx *ctx, unsigned int *seed) {
+
+    const struct stress_config *cfg = ctx->cfg;
+    int weight[NR_OPS], total = 0, r, op;
+
+    /* The permission of the device decides what can be done at all */
+    weight[OP_READ] = ctx->dev->can_read ? cfg->ratio[OP_READ] : 0;
+    weight[OP_WRITE] = ctx->dev->can_write ? cfg->ratio[OP_WRITE] : 0;
+    weight[OP_SEEK] = cfg->ratio[OP_SEEK];
+    for (op = 0; op < NR_OPS; op++)
+        total += weight[op];
+    if (!total)
+        return ctx->dev->can_read ? OP_READ : OP_WRITE;
+
+    r = rand_r(seed) % total;
+    for (op = 0; op < NR_OPS - 1; op++) {
+        if (r < weight[op])
+            break;
+        r -= weight[op];
+    }
+    return op;
+}
+
+static void *thread_fn(void *data) {
+
+    struct thread_ctx *ctx = data;
+    const struct stress_config *cfg = ctx->cfg;
+    const struct device_info *dev = ctx->dev;
+    unsigned int seed = cfg->seed + ctx->id * 7919;
+    long len = cfg->block, i, b, first, nr;
+    uint64_t seq = 0, t0, t1;
+    char *buf, *scratch;
+    enum op_type op;
+    off_t pos;
+    ssize_t ret;
+    int fd, flags;
+
+    if (ctx->cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(ctx->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+            fprintf(stderr, "thread %d: cannot pin to CPU %d\n", ctx->id, ctx->cpu);
+    }
+
+    buf = malloc(len * cfg->max_blocks);
+    scratch = malloc(len);
+    if (!buf || !scratch) {
+        ctx->errors++;
+        goto out_free;
+    }
+
+    flags = (dev->can_read && dev->can_write) ? O_RDWR : (dev->can_read ? O_RDONLY : O_WRONLY);
+    fd = open(dev->path, flags);
+    if (fd < 0) {
+        fprintf(stderr, "open %s: %s\n", dev->path, strerror(errno));
+        ctx->errors++;
+        goto out_free;
+    }
+
+    for (i = 0; !stop && (cfg->seconds || i < cfg->ops); i++) {
+        op = pick_op(ctx, &seed);
+        nr = 1 + rand_r(&seed) % (cfg->max_blocks < dev->nr_blocks ? cfg->max_blocks : dev->nr_blocks);
+        first = rand_r(&seed) % (dev->nr_blocks - nr + 1);
+        pos = first * len;
+
+        if (op == OP_WRITE) {
+            for (b = 0; b < nr; b++)
+                block_fill(buf + b * len, len, ctx->id, ++seq);
+            t0 = now_ns();
+            ret = pwrite(fd, buf, nr * len, pos);
+            t1 = now_ns();
+        } else if (op == OP_READ) {
+            t0 = now_ns();
+            ret = pread(fd, buf, nr * len, pos);
+            t1 = now_ns();
+        } else {
+            /* Move the file position, then use it with a plain read()/write() of one block */
+            nr = 1;
+            t0 = now_ns();
+            ret = lseek(fd, pos, SEEK_SET);
+            t1 = now_ns();
+            if (ret != pos) {
+                ctx->errors++;
+                continue;
+            }
+            if (dev->can_read) {
+                ret = read(fd, buf, len);
+            } else {
+                block_fill(buf, len, ctx->id, ++seq);
+                ret = write(fd, buf, len);
+            }
+            if (ret >= 0 && lseek(fd, 0, SEEK_CUR) != pos + ret)
+                ctx->errors++;
+        }
+        record_latency(ctx, op, t1 - t0);
+
+        if (ret < 0) {
+            ctx->errors++;
+            continue;
+        }
+        if (ret != nr * len) {
+            ctx->short_io++;
+            continue;
+        }
+
+        /* Only writable devices hold blocks of a known format */
+        if (dev->can_read && dev->can_write && (op == OP_READ || (op == OP_SEEK && dev->can_read)))
+            verify_blocks(ctx, buf, nr, first, scratch);
+    }
+
+    close(fd);
+out_free:
+    free(scratch);
+    free(buf);
+    return NULL;
+}
+
+/* Find out what a device allows and how large it is, then give it a known content */
+static int device_setup(struct device_info *dev, long block) {
+
+    off_t size;
+    char *buf;
+    long i;
+    int fd;
+
+    fd = open(dev->path, O_RDWR);
+    if (fd >= 0) {
+        dev->can_read = dev->can_write = 1;
+    } else if ((fd = open(dev->path, O_RDONLY)) >= 0) {
+        dev->can_read = 1;
+    } else if ((fd = open(dev->path, O_WRONLY)) >= 0) {
+        dev->can_write = 1;
+    } else {
+        fprintf(stderr, "open %s: %s\n", dev->path, strerror(errno));
+        return -1;
+    }
+
+    /* FIFO devices have no size and no file position */
+    size = lseek(fd, 0, SEEK_END);
+    if (size < 0) {
+        fprintf(stderr, "%s: %s, skipped\n", dev->path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    dev->nr_blocks = size / block;
+    if (!dev->nr_blocks) {
+        fprintf(stderr, "%s: smaller than one block, skipped\n", dev->path);
+        close(fd);
+        return -1;
+    }
+
+    if (dev->can_read && dev->can_write) {
+        buf = malloc(block);
+        if (!buf) {
+            close(fd);
+            return -1;
+        }
+        for (i = 0; i < dev->nr_blocks; i++) {
+            block_fill(buf, block, FILL_WRITER, i);
+            if (pwrite(fd, buf, block, i * block) != block) {
+                fprintf(stderr, "%s: cannot initialize block %ld\n", dev->path, i);
+                free(buf);
+                close(fd);
+                return -1;
+            }
+        }
+        free(buf);
+    }
+
+    close(fd);
+    return 0;
+}
+
+static int parse_ratio(const char *arg, int *ratio) {
+
+    if (sscanf(arg, "%d:%d:%d", &ratio[OP_READ], &ratio[OP_WRITE], &ratio[OP_SEEK]) != 3)
+        return -1;
+    if (ratio[OP_READ] < 0 || ratio[OP_WRITE] < 0 || ratio[OP_SEEK] < 0)
+        return -1;
+    return (ratio[OP_READ] + ratio[OP_WRITE] + ratio[OP_SEEK]) ? 0 : -1;
+}
+
+static int parse_cpus(const char *arg, int *cpus) {
+
+    char *copy, *tok, *save = NULL;
+    int n = 0;
+
+    copy = strdup(arg);
+    if (!copy)
+        return -1;
+    for (tok = strtok_r(copy, ",", &save); tok && n < MAX_CPUS; tok = strtok_r(NULL, ",", &save))
+        cpus[n++] = atoi(tok);
+    free(copy);
+
+    return n ? n : -1;
+}
+
+static void print_report(struct thread_ctx *ctx, int nr_threads, int histogram) {
+
+    long total[NR_OPS] = { 0 }, errors = 0, short_io = 0, corrupt = 0;
+    int t, op, b;
+
+    printf("%-16s %6s %4s %-5s %10s %10s %10s %10s %7s %6s %7s\n", "device", "thread", "cpu", "op",
+           "ops", "p50(ns)", "p99(ns)", "max(ns)", "errors", "short", "corrupt");
+    for (t = 0; t < nr_threads; t++) {
+        for (op = 0; op < NR_OPS; op++) {
+            if (!ctx[t].ops[op])
+                continue;
+            printf("%-16s %6d %4d %-5s %10ld %10llu %10llu %10llu %7ld %6ld %7ld\n", ctx[t].dev->path,
+                   ctx[t].id, ctx[t].cpu, op_name[op], ctx[t].ops[op],
+                   (unsigned long long)hist_percentile(ctx[t].hist[op], ctx[t].ops[op], 0.50),
+                   (unsigned long long)hist_percentile(ctx[t].hist[op], ctx[t].ops[op], 0.99),
+                   (unsigned long long)ctx[t].max_ns[op], ctx[t].errors, ctx[t].short_io, ctx[t].corrupt);
+            total[op] += ctx[t].ops[op];
+
+            if (!histogram)
+                continue;
+            for (b = 0; b < NR_BUCKETS; b++)
+                if (ctx[t].hist[op][b])
+                    printf("    [%10llu, %10llu) ns %10llu\n", b ? 1ull << b : 0ull, 2ull << b,
+                           (unsigned long long)ctx[t].hist[op][b]);
+        }
+        errors += ctx[t].errors;
+        short_io += ctx[t].short_io;
+        corrupt += ctx[t].corrupt;
+    }
+
+    printf("total: %ld reads, %ld writes, %ld seeks, %ld errors, %ld short, %ld corrupt blocks\n",
+           total[OP_READ], total[OP_WRITE], total[OP_SEEK], errors, short_io, corrupt);
+}
+
+static void usage(const char *prog) {
+
+    printf("Usage: %s [options]\n", prog);
+    printf("  -d <device>     device node, repeat for several devices (default every /dev/pcdev-*)\n");
+    printf("  -t <threads>    threads per device (default 2)\n");
+    printf("  -m <r:w:s>      weights of pread, pwrite and lseek+read/write (default 70:25:5)\n");
+    printf("  -n <ops>        operations per thread (default %d)\n", DEFAULT_OPS);
+    printf("  -T <seconds>    run for a time instead of a number of operations\n");
+    printf("  -b <bytes>      block size, the unit of every I/O and of the integrity check (default 64)\n");
+    printf("  -k <blocks>     at most this many blocks per I/O (default 4)\n");
+    printf("  -a              pin thread N to CPU N\n");
+    printf("  -c <cpus>       pin the threads round-robin to these CPUs, e.g. 0,1\n");
+    printf("  -H              print the latency histogram of every thread\n");
+    printf("  -s <seed>       random seed (default 1)\n");
+    printf("Writable and readable devices are filled with known blocks first, every block read back is verified.\n");
+    printf("Exits non-zero on errors or corrupt blocks.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct stress_config cfg = {
+        .threads = 2,
+        .ratio = { 70, 25, 5 },
+        .ops = DEFAULT_OPS,
+        .block = 64,
+        .max_blocks = 4,
+        .seed = 1,
+    };
+    struct device_info devs[MAX_DEVICES] = { { 0 } };
+    struct thread_ctx *ctx;
+    glob_t found = { 0 };
+    int opt, pin = 0, d, t, nr_devs = 0, nr_threads = 0, failed = 0;
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t g;
+
+    while ((opt = getopt(argc, argv, "d:t:m:n:T:b:k:ac:Hs:h")) != -1) {
+        switch (opt) {
+            case 'd':
+                if (cfg.nr_devices == MAX_DEVICES) {
+                    fprintf(stderr, "At most %d devices\n", MAX_DEVICES);
+                    return 1;
+                }
+                cfg.devices[cfg.nr_devices++] = optarg;
+                break;
+            case 't':
+                cfg.threads = atoi(optarg);
+                if (cfg.threads <= 0)
+                    goto bad_arg;
+                break;
+            case 'm':
+                if (parse_ratio(optarg, cfg.ratio))
+                    goto bad_arg;
+                break;
+            case 'n':
+                cfg.ops = atol(optarg);
+                if (cfg.ops <= 0)
+                    goto bad_arg;
+                break;
+            case 'T':
+                cfg.seconds = atoi(optarg);
+                if (cfg.seconds <= 0)
+                    goto bad_arg;
+                break;
+            case 'b':
+                cfg.block = atol(optarg);
+                if (cfg.block < (long)sizeof(struct block_hdr) || cfg.block > 65535)
+                    goto bad_arg;
+                break;
+            case 'k':
+                cfg.max_blocks = atol(optarg);
+                if (cfg.max_blocks <= 0)
+                    goto bad_arg;
+                break;
+            case 'a':
+                pin = 1;
+                break;
+            case 'c':
+                cfg.nr_cpus = parse_cpus(optarg, cfg.cpus);
+                if (cfg.nr_cpus < 0)
+                    goto bad_arg;
+                break;
+            case 'H':
+                cfg.histogram = 1;
+                break;
+            case 's':
+                cfg.seed = strtoul(optarg, NULL, 0);
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                goto bad_arg;
+        }
+    }
+
+    if (!cfg.nr_devices) {
+        if (glob("/dev/pcdev-*", 0, NULL, &found) || !found.gl_pathc) {
+            fprintf(stderr, "No /dev/pcdev-* found, is the driver loaded?\n");
+            return 1;
+        }
+        for (g = 0; g < found.gl_pathc && cfg.nr_devices < MAX_DEVICES; g++)
+            cfg.devices[cfg.nr_devices++] = found.gl_pathv[g];
+    }
+
+    for (d = 0; d < cfg.nr_devices; d++) {
+        devs[nr_devs].path = cfg.devices[d];
+        if (!device_setup(&devs[nr_devs], cfg.block))
+            nr_devs++;
+    }
+    if (!nr_devs) {
+        fprintf(stderr, "No usable device\n");
+        return 1;
+    }
+
+    ctx = calloc(nr_devs * cfg.threads, sizeof(*ctx));
+    if (!ctx) {
+        fprintf(stderr, "Cannot allocate the thread contexts\n");
+        return 1;
+    }
+
+    for (d = 0; d < nr_devs; d++) {
+        for (t = 0; t < cfg.threads; t++, nr_threads++) {
+            struct thread_ctx *c = &ctx[nr_threads];
+
+            c->cfg = &cfg;
+            c->dev = &devs[d];
+            c->id = nr_threads;
+            if (cfg.nr_cpus > 0)
+                c->cpu = cfg.cpus[nr_threads % cfg.nr_cpus];
+            else
+                c->cpu = pin ? nr_threads % (nr_cpus > 0 ? nr_cpus : 1) : -1;
+        }
+    }
+
+    for (t = 0; t < nr_threads; t++) {
+        ctx[t].started = !pthread_create(&ctx[t].thread, NULL, thread_fn, &ctx[t]);
+        if (!ctx[t].started)
+            ctx[t].errors++;
+    }
+
+    if (cfg.seconds) {
+        sleep(cfg.seconds);
+        stop = 1;
+    }
+
+    for (t = 0; t < nr_threads; t++)
+        if (ctx[t].started)
+            pthread_join(ctx[t].thread, NULL);
+
+    print_report(ctx, nr_threads, cfg.histogram);
+    for (t = 0; t < nr_threads; t++)
+        failed |= ctx[t].errors || ctx[t].corrupt;
+
+    free(ctx);
+    globfree(&found);
+    return failed;
+
+bad_arg:
+    usage(argv[0]);
+    return 1;
+}
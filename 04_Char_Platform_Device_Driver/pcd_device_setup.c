@@ -1,6 +1,8 @@
 /*
  * @brief: Create 2 platform devices and initialize them with required information
  *         Register platform devices with the Linux kernel
+ *         More devices are created at runtime through configfs:
+ *         mkdir /sys/kernel/config/pcd/<name>, set size/permission/serial_number, echo 1 > enable
  * @author: NghiaPham
  * @date: 2020/09/30
  * @version: v0.1
@@ -8,11 +10,34 @@
  */
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/configfs.h>
+#include <linux/idr.h>
+#include <linux/slab.h>
 #include "platform.h"
 
 #undef pr_fmt
 #define pr_fmt(fmt) "[%s]: " fmt, __func__
 
+#define SERIAL_LEN      32
+
+/* One device created through configfs, registered while enable is 1 */
+struct pcdev_item {
+    struct config_item item;
+    struct mutex lock;          /* Serializes the attributes against enable */
+    struct pcdev_platform_data pdata;
+    char serial_number[SERIAL_LEN];
+    struct platform_device *pdev;
+    int id;
+};
+
+/* The static devices below may be left out, then every device comes from configfs */
+static bool legacy_devices = true;
+module_param(legacy_devices, bool, S_IRUGO);
+MODULE_PARM_DESC(legacy_devices, "Register the four built-in devices (pcdev-0..3)");
+
+/* Platform device ids, hence minors, of the configfs devices */
+DEFINE_IDA(pcdev_ida);
+
 /* Callback to free the device after all references have gone away */
 void pcdev_release(struct device *dev) {
     // TODO: 
@@ -71,21 +96,254 @@ struct platform_device *platform_pcdevs[] = {
     &platform_pcdev_4
 };
 
+struct pcdev_item *to_pcdev_item(struct config_item *item) {
+
+    return container_of(item, struct pcdev_item, item);
+}
+
+ssize_t pcdev_size_show(struct config_item *item, char *page) {
+
+    return sprintf(page, "%d\n", to_pcdev_item(item)->pdata.size);
+}
+
+/* The driver reads the platform data at probe, so it is frozen while the device is enabled */
+ssize_t pcdev_size_store(struct config_item *item, const char *page, size_t count) {
+
+    int ret, size;
+    struct pcdev_item *dev = to_pcdev_item(item);
+
+    ret = kstrtoint(page, 0, &size);
+    if (ret)
+        return ret;
+    if (size <= 0)
+        return -EINVAL;
+
+    mutex_lock(&dev->lock);
+    if (dev->pdev)
+        ret = -EBUSY;
+    else
+        dev->pdata.size = size;
+    mutex_unlock(&dev->lock);
+
+    return ret ? ret : count;
+}
+
+ssize_t pcdev_permission_show(struct config_item *item, char *page) {
+
+    return sprintf(page, "%d\n", to_pcdev_item(item)->pdata.permission);
+}
+
+ssize_t pcdev_permission_store(struct config_item *item, const char *page, size_t count) {
+
+    int ret, permission;
+    struct pcdev_item *dev = to_pcdev_item(item);
+
+    ret = kstrtoint(page, 0, &permission);
+    if (ret)
+        return ret;
+    if ((permission != RDONLY) && (permission != WRONLY) && (permission != RDWR))
+        return -EINVAL;
+
+    mutex_lock(&dev->lock);
+    if (dev->pdev)
+        ret = -EBUSY;
+    else
+        dev->pdata.permission = permission;
+    mutex_unlock(&dev->lock);
+
+    return ret ? ret : count;
+}
+
+ssize_t pcdev_serial_number_show(struct config_item *item, char *page) {
+
+    return sprintf(page, "%s\n", to_pcdev_item(item)->serial_number);
+}
+
+ssize_t pcdev_serial_number_store(struct config_item *item, const char *page, size_t count) {
+
+    int ret = 0;
+    struct pcdev_item *dev = to_pcdev_item(item);
+
+    if (!count || (count >= SERIAL_LEN))
+        return -EINVAL;
+
+    mutex_lock(&dev->lock);
+    if (dev->pdev) {
+        ret = -EBUSY;
+    } else {
+        /* echo adds a newline which is not part of the serial number */
+        strscpy(dev->serial_number, page, SERIAL_LEN);
+        dev->serial_number[strcspn(dev->serial_number, "\n")] = '\0';
+    }
+    mutex_unlock(&dev->lock);
+
+    return ret ? ret : count;
+}
+
+ssize_t pcdev_enable_show(struct config_item *item, char *page) {
+
+    return sprintf(page, "%d\n", to_pcdev_item(item)->pdev != NULL);
+}
+
+/* Register or unregister the platform device, the driver probes it like a static one */
+ssize_t pcdev_enable_store(struct config_item *item, const char *page, size_t count) {
+
+    int ret = 0;
+    bool enable;
+    struct platform_device *pdev;
+    struct pcdev_item *dev = to_pcdev_item(item);
+
+    ret = kstrtobool(page, &enable);
+    if (ret)
+        return ret;
+
+    mutex_lock(&dev->lock);
+    if (enable && !dev->pdev) {
+        /* The platform data is copied, serial_number points into the item which outlives the device */
+        pdev = platform_device_register_data(NULL, "pcdev-Ax", dev->id, &dev->pdata, sizeof(dev->pdata));
+        if (IS_ERR(pdev))
+            ret = PTR_ERR(pdev);
+        else
+            dev->pdev = pdev;
+    } else if (!enable && dev->pdev) {
+        platform_device_unregister(dev->pdev);
+        dev->pdev = NULL;
+    }
+    mutex_unlock(&dev->lock);
+
+    return ret ? ret : count;
+}
+
+CONFIGFS_ATTR(pcdev_, size);
+CONFIGFS_ATTR(pcdev_, permission);
+CONFIGFS_ATTR(pcdev_, serial_number);
+CONFIGFS_ATTR(pcdev_, enable);
+
+struct configfs_attribute *pcdev_attrs[] = {
+    &pcdev_attr_size,
+    &pcdev_attr_permission,
+    &pcdev_attr_serial_number,
+    &pcdev_attr_enable,
+    NULL
+};
+
+/* Last reference of an item is gone, its device was unregistered by rmdir */
+void pcdev_item_release(struct config_item *item) {
+
+    struct pcdev_item *dev = to_pcdev_item(item);
+
+    ida_free(&pcdev_ida, dev->id);
+    kfree(dev);
+}
+
+struct configfs_item_operations pcdev_item_ops = {
+    .release = pcdev_item_release
+};
+
+const struct config_item_type pcdev_item_type = {
+    .ct_item_ops = &pcdev_item_ops,
+    .ct_attrs = pcdev_attrs,
+    .ct_owner = THIS_MODULE
+};
+
+/* mkdir: a disabled device with default settings and the directory name as serial number */
+struct config_item *pcdev_make_item(struct config_group *group, const char *name) {
+
+    struct pcdev_item *dev;
+
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if (!dev)
+        return ERR_PTR(-ENOMEM);
+
+    /* Ids of the built-in devices are never handed out */
+    dev->id = ida_alloc_range(&pcdev_ida, ARRAY_SIZE(platform_pcdevs), PCD_MAX_DEVICES - 1, GFP_KERNEL);
+    if (dev->id < 0) {
+        kfree(dev);
+        return ERR_PTR(-ENOSPC);
+    }
+
+    mutex_init(&dev->lock);
+    strscpy(dev->serial_number, name, SERIAL_LEN);
+    dev->pdata.size = 512;
+    dev->pdata.permission = RDWR;
+    dev->pdata.serial_number = dev->serial_number;
+
+    config_item_init_type_name(&dev->item, name, &pcdev_item_type);
+
+    return &dev->item;
+}
+
+/* rmdir: the device goes away with its directory */
+void pcdev_drop_item(struct config_group *group, struct config_item *item) {
+
+    struct pcdev_item *dev = to_pcdev_item(item);
+
+    mutex_lock(&dev->lock);
+    if (dev->pdev) {
+        platform_device_unregister(dev->pdev);
+        dev->pdev = NULL;
+    }
+    mutex_unlock(&dev->lock);
+
+    config_item_put(item);
+}
+
+struct configfs_group_operations pcdev_group_ops = {
+    .make_item = pcdev_make_item,
+    .drop_item = pcdev_drop_item
+};
+
+const struct config_item_type pcdev_group_type = {
+    .ct_group_ops = &pcdev_group_ops,
+    .ct_owner = THIS_MODULE
+};
+
+/* /sys/kernel/config/pcd */
+struct configfs_subsystem pcdev_subsys;
+
 static int __init pcdev_platform_init(void) {
+
+    int ret;
+
     /* Register platform-level device */
-    platform_add_devices(platform_pcdevs, ARRAY_SIZE(platform_pcdevs));
+    if (legacy_devices)
+        platform_add_devices(platform_pcdevs, ARRAY_SIZE(platform_pcdevs));
+
+    config_group_init_type_name(&pcdev_subsys.su_group, "pcd", &pcdev_group_type);
+    mutex_init(&pcdev_subsys.su_mutex);
+    ret = configfs_register_subsystem(&pcdev_subsys);
+    if (ret) {
+        pr_err("Cannot register the configfs subsystem\n");
+        goto legacy_del;
+    }
 
     pr_info("Platform device setup module loaded\n");
 
     return 0;
+
+legacy_del:
+    if (legacy_devices) {
+        platform_device_unregister(&platform_pcdev_1);
+        platform_device_unregister(&platform_pcdev_2);
+        platform_device_unregister(&platform_pcdev_3);
+        platform_device_unregister(&platform_pcdev_4);
+    }
+    return ret;
 }
 
 static void __exit pcdev_platform_exit(void) {
+
+    /* configfs holds a module reference per directory, so no configfs device is left here */
+    configfs_unregister_subsystem(&pcdev_subsys);
+    ida_destroy(&pcdev_ida);
+
     /* Unregister platform-level device */
-    platform_device_unregister(&platform_pcdev_1);
-    platform_device_unregister(&platform_pcdev_2);
-    platform_device_unregister(&platform_pcdev_3);
-    platform_device_unregister(&platform_pcdev_4);
+    if (legacy_devices) {
+        platform_device_unregister(&platform_pcdev_1);
+        platform_device_unregister(&platform_pcdev_2);
+        platform_device_unregister(&platform_pcdev_3);
+        platform_device_unregister(&platform_pcdev_4);
+    }
 
     pr_info("Platform device setup module unloaded\n");
 }
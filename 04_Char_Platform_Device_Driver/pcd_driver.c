@@ -13,17 +13,28 @@
 #include <linux/device.h>
 #include <linux/kdev_t.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
 #include <linux/mod_devicetable.h>
+#include <linux/ktime.h>
+#include <linux/mempool.h>
+#include <linux/kref.h>
+#include <linux/xarray.h>
 #include "platform.h"
 
+#include "pcd_stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "pcd_trace.h"
+
 #undef pr_fmt
 #define pr_fmt(fmt) "[%s]: " fmt, __func__
 
 #define CLASS_NAME      "pcd_class"
 #define DEV_NAME        "pcdevs"
-#define NO_OF_DEVICES   4
 
 /* Create dummy device configure */
 enum pcdev_name {
@@ -69,40 +80,79 @@ struct platform_device_id pcdevs_ids[] = {
 struct pcdev_private_data {
     struct pcdev_platform_data pdata;
     dev_t dev_num;
-    char *buffer;
-    struct cdev cdev;
+    int minor;                  /* Index in the device registry, the platform device id */
+    struct kref ref;            /* Held by the bound device and by every open file */
+    struct page **pages;        /* Backing pages, allocated on demand */
+    unsigned long nr_pages;
+    struct cdev *cdev;          /* Allocated apart, it may outlive the device data */
+    struct pcd_stats __percpu *stats;
+    struct dentry *debugfs;     /* <debugfs>/pcd_class/pcdev-N */
 };
 
 /* Structure represents driver private data */
 struct pcdrv_private_data {
-    int total_device;
+    atomic_t total_device;
     dev_t device_number_base;
     struct class *class_pcd;
-    struct device *device_pcd;
+    struct dentry *debugfs_root;
+    struct xarray devices;      /* Minor -> struct pcdev_private_data of the bound devices */
+    struct kmem_cache *dev_cache;   /* struct pcdev_private_data of every device */
+    mempool_t *page_pool;       /* Buffer pages shared by every device, with a reserve for memory pressure */
+};
+struct pcdrv_private_data pcdrv_data = {
+    .total_device = ATOMIC_INIT(0),
+    .devices = XARRAY_INIT(pcdrv_data.devices, 0),
 };
-struct pcdrv_private_data pcdrv_data;
+
+/* Buffer pages the pool keeps in reserve for all devices together */
+static int pool_pages = 64;
+module_param(pool_pages, int, S_IRUGO);
+MODULE_PARM_DESC(pool_pages, "Reserved buffer pages shared by the devices (default: 64)");
+
+/* The prototype functions for the page backed device buffer */
+struct page *pcd_page_alloc(void);
+void pcd_page_free(struct page *page);
+int pcd_buffer_init(struct pcdev_private_data *dev_data);
+void pcd_buffer_free(void *data);
+struct page *pcd_buffer_page(struct pcdev_private_data *dev_data, unsigned long index, bool alloc);
+ssize_t pcd_buffer_read(struct pcdev_private_data *dev_data, struct iov_iter *to, size_t count, loff_t pos);
+ssize_t pcd_buffer_write(struct pcdev_private_data *dev_data, struct iov_iter *from, size_t count, loff_t pos, bool nowait);
 
 /* The prototype functions for the file operations of character driver */
 int check_permission(int permission, int access_mode);
 int pcd_open(struct inode *inode, struct file *filp);
 int pcd_release(struct inode *inode, struct file *filp);
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t *f_pos);
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos);
+ssize_t pcd_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_write_iter(struct kiocb *iocb, struct iov_iter *from);
 loff_t pcd_lseek(struct file *filp, loff_t offset, int whence);
+int pcd_mmap(struct file *filp, struct vm_area_struct *vma);
 
 /* The prototype functions for the platform driver */
 int pcd_platform_driver_probe(struct platform_device *pdev);
 int pcd_platform_driver_remove(struct platform_device *pdev);
 
+/* The prototype functions for the device registry */
+struct pcdev_private_data *pcd_dev_get(int minor);
+void pcd_dev_release(struct kref *ref);
+void pcd_dev_put(void *data);
+void pcd_minor_free(void *data);
+
 struct file_operations pcd_fops = {
     .open = pcd_open,
-    .write = pcd_write,
-    .read = pcd_read,
+    .write_iter = pcd_write_iter,
+    .read_iter = pcd_read_iter,
     .release = pcd_release,
     .llseek = pcd_lseek,
+    .mmap = pcd_mmap,
+    /* splice/sendfile run through read_iter/write_iter, device pages are handed to the pipe by reference */
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
     .owner = THIS_MODULE
 };
 
+/* Read only <debugfs>/pcd_class/pcdev-N/stats, see pcd_stats.h */
+DEFINE_SHOW_ATTRIBUTE(pcd_stats);
+
 struct platform_driver pcd_platform_driver = {
     .probe = pcd_platform_driver_probe,
     .remove = pcd_platform_driver_remove,
@@ -114,6 +164,141 @@ struct platform_driver pcd_platform_driver = {
     }
 };
 
+/*
+ * Allocate a zeroed buffer page, the pool's reserve keeps writers going under memory pressure.
+ * Pages only return to the pool when buffers are freed, so the reserve is taken without
+ * waiting: an empty one fails with -ENOMEM instead of blocking the writer.
+ */
+struct page *pcd_page_alloc(void) {
+
+    struct page *page;
+
+    page = alloc_page(GFP_HIGHUSER | __GFP_ZERO | __GFP_NOWARN);
+    if (page)
+        return page;
+
+    page = mempool_alloc(pcdrv_data.page_pool, GFP_NOWAIT | __GFP_NOWARN);
+    if (page)
+        clear_highpage(page);
+
+    return page;
+}
+
+/*
+ * Drop the buffer's reference of a page. Mappings and pipes hold references of their own and
+ * may drop them concurrently, so only whoever drops the last one owns the page: when that is
+ * the buffer, the page refills the pool, otherwise the last user frees it with its put_page().
+ */
+void pcd_page_free(struct page *page) {
+
+    if (page_ref_dec_and_test(page)) {
+        set_page_count(page, 1);
+        mempool_free(page, pcdrv_data.page_pool);
+    }
+}
+
+/* Allocate the page array of a device, the pages themselves are allocated on first use */
+int pcd_buffer_init(struct pcdev_private_data *dev_data) {
+
+    dev_data->nr_pages = DIV_ROUND_UP(dev_data->pdata.size, PAGE_SIZE);
+    dev_data->pages = kvcalloc(dev_data->nr_pages, sizeof(*dev_data->pages), GFP_KERNEL);
+    if (!dev_data->pages)
+        return -ENOMEM;
+
+    return 0;
+}
+
+/* Release every allocated page and the page array, on the last put of the device */
+void pcd_buffer_free(void *data) {
+
+    unsigned long i;
+    struct pcdev_private_data *dev_data = data;
+
+    /* Pages still mapped by user space keep their own reference until munmap */
+    for (i = 0; i < dev_data->nr_pages; i++)
+        if (dev_data->pages[i])
+            pcd_page_free(dev_data->pages[i]);
+
+    kvfree(dev_data->pages);
+}
+
+/* Look up the page backing a page index of the device, optionally allocating a zeroed one */
+struct page *pcd_buffer_page(struct pcdev_private_data *dev_data, unsigned long index, bool alloc) {
+
+    struct page *page, *old;
+
+    page = READ_ONCE(dev_data->pages[index]);
+    if (page || !alloc)
+        return page;
+
+    page = pcd_page_alloc();
+    if (!page)
+        return ERR_PTR(-ENOMEM);
+
+    /* Concurrent writers may fault in the same page, only one of them wins */
+    old = cmpxchg(&dev_data->pages[index], NULL, page);
+    if (old) {
+        pcd_page_free(page);
+        page = old;
+    }
+
+    return page;
+}
+
+/* Copy count bytes at pos into the iterator page by page, holes read back as zeroes */
+ssize_t pcd_buffer_read(struct pcdev_private_data *dev_data, struct iov_iter *to, size_t count, loff_t pos) {
+
+    size_t done = 0, chunk, copied;
+    unsigned long offset;
+    struct page *page;
+
+    while (done < count) {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - done);
+
+        page = pcd_buffer_page(dev_data, (pos + done) >> PAGE_SHIFT, false);
+        if (page)
+            copied = copy_page_to_iter(page, offset, chunk, to);
+        else
+            copied = iov_iter_zero(chunk, to);
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    return (done || !count) ? done : -EFAULT;
+}
+
+/* Copy count bytes from the iterator to pos, allocating the pages being written */
+ssize_t pcd_buffer_write(struct pcdev_private_data *dev_data, struct iov_iter *from, size_t count, loff_t pos, bool nowait) {
+
+    size_t done = 0, chunk, copied;
+    unsigned long offset;
+    struct page *page;
+
+    while (done < count) {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - done);
+
+        /* A nowait writer must not block in the page allocator */
+        page = pcd_buffer_page(dev_data, (pos + done) >> PAGE_SHIFT, !nowait);
+        if (IS_ERR_OR_NULL(page)) {
+            if (done)
+                break;
+            return page ? PTR_ERR(page) : -EAGAIN;
+        }
+
+        copied = copy_page_from_iter(page, offset, chunk, from);
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    return (done || !count) ? done : -EFAULT;
+}
+
 int check_permission(int permission, int access_mode){
 
     if (permission == RDWR)
@@ -136,73 +321,98 @@ int pcd_open(struct inode *inode, struct file *filp) {
     struct pcdev_private_data *pcdev_data;
 
     /* Find out on on which device file open was attempted by user space */
-    minor_no = MINOR(inode->i_rdev);
+    minor_no = MINOR(inode->i_rdev) - MINOR(pcdrv_data.device_number_base);
 
-    /* Get device's private data structure */
-    pcdev_data = container_of(inode->i_cdev, struct pcdev_private_data, cdev);
+    /* Get device's private data structure, the file holds a reference until release */
+    pcdev_data = pcd_dev_get(minor_no);
+    if (!pcdev_data)
+        return -ENODEV;
 
     /* Supply device private data to other method of the driver */
     filp->private_data = pcdev_data;
 
+    /* Reads and writes honour IOCB_NOWAIT, so preadv2/pwritev2 may use RWF_NOWAIT */
+    filp->f_mode |= FMODE_NOWAIT;
+
     /* Check permission */
     ret = check_permission(pcdev_data->pdata.permission, filp->f_mode);
-    if (!ret)
+    if (!ret) {
         pr_info("Open was successful\n");
-    else
+    } else {
         pr_info("Open was unsuccessful\n");
+        pcd_dev_put(pcdev_data);
+    }
 
     return ret;
 }
 
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t *f_pos) {
+ssize_t pcd_read_iter(struct kiocb *iocb, struct iov_iter *to) {
 
     int max_size;
-    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+    ssize_t ret;
+    size_t count = iov_iter_count(to);
+    size_t requested = count;
+    loff_t pos = iocb->ki_pos;
+    /* Only read the clock when somebody listens to the tracepoint */
+    u64 start = trace_pcd_read_enabled() ? ktime_get_ns() : 0;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
     max_size = pcdev_data->pdata.size;
 
-    pr_info("Read requested for %zu bytes \n",count);
-    pr_info("Current file position = %lld\n",*f_pos);
+    /* Ajust the count argument, pread may start beyond the end of the device */
+    if (pos >= max_size)
+        count = 0;
+    else if ((pos + count) > max_size)
+        count = max_size - pos;
 
-    /* Ajust the count argument */
-    if ((*f_pos + count) > max_size)
-        count = max_size - *f_pos;
+    ret = pcd_buffer_read(pcdev_data, to, count, pos);
+    if (ret < 0)
+        goto out;
 
-    if (copy_to_user(buff, pcdev_data->buffer, count))
-        return -EFAULT;
-    
     /* Update current file position */
-    *f_pos += count;
-    pr_info("Number of bytes successfully read = %zu\n", count);
-    pr_info("Updated file position = %lld\n",*f_pos);
+    iocb->ki_pos += ret;
 
-    return count;
+out:
+    pcd_stats_io(pcdev_data->stats, false, requested, ret);
+    trace_pcd_read(file_inode(iocb->ki_filp)->i_rdev, pos, requested, ret,
+                   start ? ktime_get_ns() - start : 0);
+    return ret;
 }
 
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos) {
+ssize_t pcd_write_iter(struct kiocb *iocb, struct iov_iter *from) {
 
     int max_size;
-    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+    ssize_t ret;
+    size_t count = iov_iter_count(from);
+    size_t requested = count;
+    loff_t pos = iocb->ki_pos;
+    /* Only read the clock when somebody listens to the tracepoint */
+    u64 start = trace_pcd_write_enabled() ? ktime_get_ns() : 0;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
     max_size = pcdev_data->pdata.size;
 
-    pr_info("Write requested %zu bytes \n",count);
-    pr_info("Current file position = %lld\n",*f_pos);
-
-    /* Ajust the count argument */
-    if ((*f_pos + count) > max_size)
-        count = max_size - *f_pos;
+    /* Ajust the count argument, pwrite may start beyond the end of the device */
+    if (pos >= max_size)
+        count = 0;
+    else if ((pos + count) > max_size)
+        count = max_size - pos;
 
-    if (!count)
-        return -ENOMEM;
+    if (!count) {
+        ret = -ENOMEM;
+        goto out;
+    }
 
-    if (copy_from_user(pcdev_data->buffer, buff, count))
-        return -EFAULT;
+    ret = pcd_buffer_write(pcdev_data, from, count, pos, iocb->ki_flags & IOCB_NOWAIT);
+    if (ret < 0)
+        goto out;
 
     /* Update current file position */
-    *f_pos += count;
-    pr_info("Number of bytes successfully written = %zu\n", count);
-    pr_info("Updated file position = %lld\n",*f_pos);
+    iocb->ki_pos += ret;
 
-    return count;
+out:
+    pcd_stats_io(pcdev_data->stats, true, requested, ret);
+    trace_pcd_write(file_inode(iocb->ki_filp)->i_rdev, pos, requested, ret,
+                    start ? ktime_get_ns() - start : 0);
+    return ret;
 }
 
 loff_t pcd_lseek(struct file *filp, loff_t offset, int whence) {
@@ -234,11 +444,54 @@ loff_t pcd_lseek(struct file *filp, loff_t offset, int whence) {
             return -EINVAL;
     }
 
-    pr_info("New value of the file position = %lld\n",filp->f_pos);
+    trace_pcd_lseek(file_inode(filp)->i_rdev, offset, whence, filp->f_pos);
     return filp->f_pos;
 }
 
+int pcd_mmap(struct file *filp, struct vm_area_struct *vma) {
+
+    unsigned long i;
+    struct page *page;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+
+    /*
+     * Only shared mappings make sense, private ones would hide the device content. Test VM_MAYSHARE:
+     * mmap() clears VM_SHARED of a MAP_SHARED mapping of a file opened read only
+     */
+    if (!(vma->vm_flags & VM_MAYSHARE))
+        return -EINVAL;
+
+    /* A write only page can't be expressed by the MMU, so write only devices are never mapped */
+    if (pcdev_data->pdata.permission == WRONLY)
+        return -EPERM;
+
+    /* Read only device: refuse writable mappings and forbid a later mprotect(PROT_WRITE) */
+    if (pcdev_data->pdata.permission == RDONLY) {
+        if (vma->vm_flags & VM_WRITE)
+            return -EPERM;
+        vma->vm_flags &= ~VM_MAYWRITE;
+    }
+
+    /* The mapping must stay inside the (page aligned) device buffer */
+    if ((vma->vm_pgoff >= pcdev_data->nr_pages) || (vma_pages(vma) > pcdev_data->nr_pages - vma->vm_pgoff))
+        return -EINVAL;
+
+    /* Populate the mapped range up front, so no fault handler is needed */
+    for (i = vma->vm_pgoff; i < vma->vm_pgoff + vma_pages(vma); i++) {
+        page = pcd_buffer_page(pcdev_data, i, true);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+    }
+
+    /*
+     * No vm_operations keep a pointer to the device: the mapping only holds references
+     * on the buffer pages, so it stays valid after the device is removed.
+     */
+    return vm_map_pages(vma, pcdev_data->pages, pcdev_data->nr_pages);
+}
+
 int pcd_release(struct inode *inode, struct file *filp) {
+    pcd_dev_put(filp->private_data);
     pr_info("Released successful\n");
     return 0;
 }
@@ -248,6 +501,7 @@ int pcd_platform_driver_probe(struct platform_device *pdev) {
     int ret;
     struct pcdev_private_data *dev_data;
     struct pcdev_platform_data *pdata;
+    struct device *device_pcd;
 
     pr_info("Device was detected\n");
 
@@ -258,13 +512,25 @@ int pcd_platform_driver_probe(struct platform_device *pdev) {
         return -EINVAL;
     }
 
-    /* Dynamically allocate memory for the device private data */
-    dev_data = devm_kzalloc(&pdev->dev, sizeof(*dev_data), GFP_KERNEL);
+    /* The platform device id is the minor, configfs devices get theirs from pcd_device_setup */
+    if ((pdev->id < 0) || (pdev->id >= PCD_MAX_DEVICES)) {
+        pr_info("Device id %d out of range\n", pdev->id);
+        return -EINVAL;
+    }
+
+    /* Device private data comes from the driver's own slab */
+    dev_data = kmem_cache_zalloc(pcdrv_data.dev_cache, GFP_KERNEL);
     if (!dev_data) {
         pr_info("Cannot allocate memory\n");
         return -ENOMEM;
     }
 
+    /* Files still open after a remove keep the data alive, the last put frees it */
+    kref_init(&dev_data->ref);
+    ret = devm_add_action_or_reset(&pdev->dev, pcd_dev_put, dev_data);
+    if (ret)
+        return ret;
+
     /* Save device private data pointer in platform device structure (release)*/
     dev_set_drvdata(&pdev->dev, dev_data);
 
@@ -279,45 +545,110 @@ int pcd_platform_driver_probe(struct platform_device *pdev) {
     pr_info("Configure item 1: %d\n", pcdev_configure[pdev->id_entry->driver_data].configure_num1);
     pr_info("Configure item 2: %d\n", pcdev_configure[pdev->id_entry->driver_data].configure_num2);
 
-    /* Dynamically allocate memory for the device buffer */
-    dev_data->buffer = devm_kzalloc(&pdev->dev, dev_data->pdata.size, GFP_KERNEL);
-    if (!dev_data->buffer) {
+    /* Only the page array is allocated here, pages are allocated on first access */
+    ret = pcd_buffer_init(dev_data);
+    if (ret) {
         pr_info("Cannot allocate memory\n");
-        return -ENOMEM;
+        return ret;
     }
 
-    dev_data->dev_num = pcdrv_data.device_number_base + pdev->id;
+    dev_data->stats = pcd_stats_alloc();
+    if (!dev_data->stats)
+        return -ENOMEM;
+
+    /* Publish the device for pcd_open() before its cdev goes live */
+    dev_data->minor = pdev->id;
+    ret = xa_insert(&pcdrv_data.devices, dev_data->minor, dev_data, GFP_KERNEL);
+    if (ret)
+        return ret;
+
+    ret = devm_add_action_or_reset(&pdev->dev, pcd_minor_free, dev_data);
+    if (ret)
+        return ret;
+
+    dev_data->dev_num = pcdrv_data.device_number_base + dev_data->minor;
+
+    dev_data->cdev = cdev_alloc();
+    if (!dev_data->cdev)
+        return -ENOMEM;
 
-    cdev_init(&dev_data->cdev, &pcd_fops);
-    dev_data->cdev.owner = THIS_MODULE;
-    ret = cdev_add(&dev_data->cdev, dev_data->dev_num, 1);
+    dev_data->cdev->ops = &pcd_fops;
+    dev_data->cdev->owner = THIS_MODULE;
+    ret = cdev_add(dev_data->cdev, dev_data->dev_num, 1);
     if (ret < 0) {
         pr_info("Cdev add failed\n");
+        kobject_put(&dev_data->cdev->kobj);
         return ret;
     }
 
     /* Create device file for the detected platform device */
-    pcdrv_data.device_pcd = device_create(pcdrv_data.class_pcd, NULL, dev_data->dev_num, NULL, "pcdev-%d", pdev->id);
-    if (IS_ERR(pcdrv_data.device_pcd)) {
-        ret = PTR_ERR(pcdrv_data.device_pcd);
-        cdev_del(&dev_data->cdev);
+    device_pcd = device_create(pcdrv_data.class_pcd, NULL, dev_data->dev_num, NULL, "pcdev-%d", dev_data->minor);
+    if (IS_ERR(device_pcd)) {
+        ret = PTR_ERR(device_pcd);
+        cdev_del(dev_data->cdev);
         return ret;
     }
 
-    pcdrv_data.total_device++;
+    atomic_inc(&pcdrv_data.total_device);
+
+    /* Statistics are optional, the device works on without debugfs */
+    dev_data->debugfs = debugfs_create_dir(dev_name(device_pcd), pcdrv_data.debugfs_root);
+    debugfs_create_file("stats", S_IRUGO, dev_data->debugfs, dev_data->stats, &pcd_stats_fops);
 
     pr_info("Probe was successful\n");
     pr_info("--------------------\n");
     return 0;
 }
 
+/* Look up the device of a minor and take a reference, NULL once the device is removed */
+struct pcdev_private_data *pcd_dev_get(int minor) {
+
+    struct pcdev_private_data *dev_data;
+
+    xa_lock(&pcdrv_data.devices);
+    dev_data = xa_load(&pcdrv_data.devices, minor);
+    if (dev_data)
+        kref_get(&dev_data->ref);
+    xa_unlock(&pcdrv_data.devices);
+
+    return dev_data;
+}
+
+/* Last reference is gone, neither the platform device nor an open file uses the data */
+void pcd_dev_release(struct kref *ref) {
+
+    struct pcdev_private_data *dev_data = container_of(ref, struct pcdev_private_data, ref);
+
+    if (dev_data->pages)
+        pcd_buffer_free(dev_data);
+    pcd_stats_free(dev_data->stats);
+    kmem_cache_free(pcdrv_data.dev_cache, dev_data);
+}
+
+/* Devres action which drops the reference of the bound device, open files drop theirs on release */
+void pcd_dev_put(void *data) {
+
+    struct pcdev_private_data *dev_data = data;
+
+    kref_put(&dev_data->ref, pcd_dev_release);
+}
+
+/* Devres action which unpublishes the device, later opens of its minor fail */
+void pcd_minor_free(void *data) {
+
+    struct pcdev_private_data *dev_data = data;
+
+    xa_erase(&pcdrv_data.devices, dev_data->minor);
+}
+
 int pcd_platform_driver_remove(struct platform_device *pdev) {
 
     struct pcdev_private_data *dev_data = dev_get_drvdata(&pdev->dev);
 
+    debugfs_remove_recursive(dev_data->debugfs);
     device_destroy(pcdrv_data.class_pcd, dev_data->dev_num);
-    cdev_del(&dev_data->cdev);
-    pcdrv_data.total_device--;
+    cdev_del(dev_data->cdev);
+    atomic_dec(&pcdrv_data.total_device);
 
     pr_info("Device was removed");
     return 0;
@@ -328,18 +659,34 @@ static int __init char_platform_driver_init(void) {
 
     int ret;
 
-    /* Dynamically allocate a device number <one device> */
-    ret = alloc_chrdev_region(&pcdrv_data.device_number_base, 0, NO_OF_DEVICES, DEV_NAME);
+    /* Reserve every minor up front, devices come and go through configfs without a reload */
+    ret = alloc_chrdev_region(&pcdrv_data.device_number_base, 0, PCD_MAX_DEVICES, DEV_NAME);
     if (ret < 0)
         goto error_out;
 
+    /* Device private data comes from its own slab, create/remove churn doesn't fragment kmalloc caches */
+    pcdrv_data.dev_cache = KMEM_CACHE(pcdev_private_data, SLAB_HWCACHE_ALIGN);
+    if (!pcdrv_data.dev_cache) {
+        ret = -ENOMEM;
+        goto unregister_allocate_dd;
+    }
+
+    pcdrv_data.page_pool = mempool_create_page_pool(max(pool_pages, 1), 0);
+    if (!pcdrv_data.page_pool) {
+        ret = -ENOMEM;
+        goto cache_destroy;
+    }
+
     /* Create class and device files </sys/class/...> */
     pcdrv_data.class_pcd = class_create(THIS_MODULE, CLASS_NAME);
     if (IS_ERR(pcdrv_data.class_pcd)) {
         ret = PTR_ERR(pcdrv_data.class_pcd);
-        goto unregister_allocate_dd;
+        goto pool_destroy;
     }
 
+    /* Every probed device adds its own directory below */
+    pcdrv_data.debugfs_root = debugfs_create_dir(CLASS_NAME, NULL);
+
     ret = platform_driver_register(&pcd_platform_driver);
     if (ret < 0)
         goto class_del;
@@ -349,10 +696,14 @@ static int __init char_platform_driver_init(void) {
     return 0;
 
 class_del:
+    debugfs_remove_recursive(pcdrv_data.debugfs_root);
     class_destroy(pcdrv_data.class_pcd);
-    unregister_chrdev_region(pcdrv_data.device_number_base, NO_OF_DEVICES);
+pool_destroy:
+    mempool_destroy(pcdrv_data.page_pool);
+cache_destroy:
+    kmem_cache_destroy(pcdrv_data.dev_cache);
 unregister_allocate_dd:
-    unregister_chrdev_region(pcdrv_data.device_number_base, NO_OF_DEVICES);
+    unregister_chrdev_region(pcdrv_data.device_number_base, PCD_MAX_DEVICES);
 error_out:
     return ret;
 
@@ -360,8 +711,11 @@ error_out:
 
 static void __exit char_platform_driver_exit(void) {
     platform_driver_unregister(&pcd_platform_driver);
+    debugfs_remove_recursive(pcdrv_data.debugfs_root);
     class_destroy(pcdrv_data.class_pcd);
-    unregister_chrdev_region(pcdrv_data.device_number_base, NO_OF_DEVICES);
+    mempool_destroy(pcdrv_data.page_pool);
+    kmem_cache_destroy(pcdrv_data.dev_cache);
+    unregister_chrdev_region(pcdrv_data.device_number_base, PCD_MAX_DEVICES);
 
     pr_info("Platform driver module unloaded\n");
 }
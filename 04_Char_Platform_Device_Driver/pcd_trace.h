@@ -0,0 +1,88 @@
+/*
+ * @brief: Tracepoints of the pcd I/O path, they cost a static branch when disabled.
+ *         Enable with: echo 1 > /sys/kernel/debug/tracing/events/pcd/enable
+ * @author: NghiaPham
+ * @ver: v0.1
+ * @date: 2020/12/20
+ *
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pcd
+
+#if !defined(PCD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define PCD_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/kdev_t.h>
+
+DECLARE_EVENT_CLASS(pcd_io,
+
+    TP_PROTO(dev_t dev, loff_t pos, size_t requested, ssize_t ret, u64 duration_ns),
+
+    TP_ARGS(dev, pos, requested, ret, duration_ns),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(loff_t, pos)
+        __field(size_t, requested)
+        __field(ssize_t, ret)
+        __field(u64, duration_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->pos = pos;
+        __entry->requested = requested;
+        __entry->ret = ret;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("dev=%d:%d pos=%lld requested=%zu ret=%zd duration=%llu ns",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->pos,
+              __entry->requested, __entry->ret, __entry->duration_ns)
+);
+
+DEFINE_EVENT(pcd_io, pcd_read,
+    TP_PROTO(dev_t dev, loff_t pos, size_t requested, ssize_t ret, u64 duration_ns),
+    TP_ARGS(dev, pos, requested, ret, duration_ns)
+);
+
+DEFINE_EVENT(pcd_io, pcd_write,
+    TP_PROTO(dev_t dev, loff_t pos, size_t requested, ssize_t ret, u64 duration_ns),
+    TP_ARGS(dev, pos, requested, ret, duration_ns)
+);
+
+TRACE_EVENT(pcd_lseek,
+
+    TP_PROTO(dev_t dev, loff_t offset, int whence, loff_t ret),
+
+    TP_ARGS(dev, offset, whence, ret),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(loff_t, offset)
+        __field(int, whence)
+        __field(loff_t, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->offset = offset;
+        __entry->whence = whence;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("dev=%d:%d offset=%lld whence=%d ret=%lld",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->offset,
+              __entry->whence, __entry->ret)
+);
+
+#endif // PCD_TRACE_H
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pcd_trace
+#include <trace/define_trace.h>
@@ -2,6 +2,9 @@
 #define WRONLY      0x02
 #define RDWR        0x03
 
+/* Minors reserved by the driver, platform device ids must stay below */
+#define PCD_MAX_DEVICES     65536
+
 struct pcdev_platform_data {
     int size;
     int permission;
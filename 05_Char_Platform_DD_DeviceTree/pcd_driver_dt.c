@@ -13,13 +13,26 @@
 #include <linux/device.h>
 #include <linux/kdev_t.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
 #include <linux/mod_devicetable.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/bitmap.h>
+#include <linux/rwsem.h>
+#include <linux/notifier.h>
 #include "platform.h"
 
+#include "pcd_stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "pcd_trace.h"
+
 #undef pr_fmt
 #define pr_fmt(fmt) "[%s]: " fmt, __func__
 
@@ -69,8 +82,13 @@ struct of_device_id org_pcdev_dt_match[] = {
 struct pcdev_private_data {
     struct pcdev_platform_data pdata;
     dev_t dev_num;
-    char *buffer;
+    int minor;
+    struct page **pages;        /* Backing pages, allocated on demand */
+    unsigned long nr_pages;
+    struct rw_semaphore resize_lock;    /* Shared by I/O, a live resize swaps the page array under it */
     struct cdev cdev;
+    struct pcd_stats __percpu *stats;
+    struct dentry *debugfs;     /* <debugfs>/pcd_class/pcdev-N */
 };
 
 /* Structure represents driver private data */
@@ -78,31 +96,82 @@ struct pcdrv_private_data {
     int total_device;
     dev_t device_number_base;
     struct class *class_pcd;
-    struct device *device_pcd;
+    struct dentry *debugfs_root;
+    struct mutex lock;          /* Probes run in parallel, protects the fields below */
+    DECLARE_BITMAP(minors, NO_OF_DEVICES);  /* Minors in use */
+    u64 load_ns;                /* When the driver was registered */
+    u64 last_probe_ns;          /* When the latest probe finished */
+    u64 probe_total_ns;         /* Sum of the probe durations, the cost of a serial probe */
+    u64 probe_max_ns;
+    int probe_count;
+    int resize_count;           /* Live resizes done for overlay changes of org,size */
+    u64 resize_total_ns;
+    u64 resize_max_ns;
 };
-struct pcdrv_private_data pcdrv_data;
+struct pcdrv_private_data pcdrv_data = {
+    .lock = __MUTEX_INITIALIZER(pcdrv_data.lock),
+};
+
+/* Probe in the caller's context instead of the async domain, to measure what async probing saves */
+static bool sync_probe;
+module_param(sync_probe, bool, S_IRUGO);
+MODULE_PARM_DESC(sync_probe, "Probe the devices synchronously (default: asynchronously)");
+
+/* The prototype functions for the page backed device buffer */
+int pcd_buffer_init(struct pcdev_private_data *dev_data);
+void pcd_buffer_free(void *data);
+struct page *pcd_buffer_page(struct pcdev_private_data *dev_data, unsigned long index, bool alloc);
+ssize_t pcd_buffer_read(struct pcdev_private_data *dev_data, struct iov_iter *to, size_t count, loff_t pos);
+ssize_t pcd_buffer_write(struct pcdev_private_data *dev_data, struct iov_iter *from, size_t count, loff_t pos, bool nowait);
+int pcd_buffer_resize(struct pcdev_private_data *dev_data, int size);
+int pcd_resize_lock(struct pcdev_private_data *dev_data, bool nowait);
 
 /* The prototype functions for the file operations of character driver */
 int check_permission(int permission, int access_mode);
 int pcd_open(struct inode *inode, struct file *filp);
 int pcd_release(struct inode *inode, struct file *filp);
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t *f_pos);
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos);
+ssize_t pcd_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_write_iter(struct kiocb *iocb, struct iov_iter *from);
 loff_t pcd_lseek(struct file *filp, loff_t offset, int whence);
+int pcd_mmap(struct file *filp, struct vm_area_struct *vma);
 
 /* The prototype functions for the platform driver */
 int pcd_platform_driver_probe(struct platform_device *pdev);
+int pcd_probe_device(struct platform_device *pdev);
+int pcd_probe_show(struct seq_file *m, void *unused);
 int pcd_platform_driver_remove(struct platform_device *pdev);
 
+/* The prototype functions for the live resize */
+int pcd_of_notify(struct notifier_block *nb, unsigned long action, void *arg);
+int pcd_resize_show(struct seq_file *m, void *unused);
+
 struct file_operations pcd_fops = {
     .open = pcd_open,
-    .write = pcd_write,
-    .read = pcd_read,
+    .write_iter = pcd_write_iter,
+    .read_iter = pcd_read_iter,
     .release = pcd_release,
     .llseek = pcd_lseek,
+    .mmap = pcd_mmap,
+    /* splice/sendfile run through read_iter/write_iter, device pages are handed to the pipe by reference */
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
     .owner = THIS_MODULE
 };
 
+/* Read only <debugfs>/pcd_class/pcdev-N/stats, see pcd_stats.h */
+DEFINE_SHOW_ATTRIBUTE(pcd_stats);
+
+/* Read only <debugfs>/pcd_class/probe, how long probing the devices took */
+DEFINE_SHOW_ATTRIBUTE(pcd_probe);
+
+/* Read only <debugfs>/pcd_class/resize, how long the live resizes took */
+DEFINE_SHOW_ATTRIBUTE(pcd_resize);
+
+/* Device tree changes made at runtime, e.g. by an overlay */
+struct notifier_block pcd_of_nb = {
+    .notifier_call = pcd_of_notify
+};
+
 struct platform_driver pcd_platform_driver = {
     .probe = pcd_platform_driver_probe,
     .remove = pcd_platform_driver_remove,
@@ -111,10 +180,166 @@ struct platform_driver pcd_platform_driver = {
     /* fall-back to driver name match */
     .driver = {
         .name = "pseudo-char-device",
-        .of_match_table = org_pcdev_dt_match
+        .of_match_table = org_pcdev_dt_match,
+        /* Devices are independent of each other, probe them in parallel off the boot path */
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS
     }
 };
 
+/* Allocate the page array of a device, the pages themselves are allocated on first use */
+int pcd_buffer_init(struct pcdev_private_data *dev_data) {
+
+    dev_data->nr_pages = DIV_ROUND_UP(dev_data->pdata.size, PAGE_SIZE);
+    dev_data->pages = kvcalloc(dev_data->nr_pages, sizeof(*dev_data->pages), GFP_KERNEL);
+    if (!dev_data->pages)
+        return -ENOMEM;
+
+    return 0;
+}
+
+/* Devres action which releases every allocated page and the page array */
+void pcd_buffer_free(void *data) {
+
+    unsigned long i;
+    struct pcdev_private_data *dev_data = data;
+
+    /* Pages still mapped by user space keep their own reference until munmap */
+    for (i = 0; i < dev_data->nr_pages; i++)
+        if (dev_data->pages[i])
+            put_page(dev_data->pages[i]);
+
+    kvfree(dev_data->pages);
+}
+
+/* Look up the page backing a page index of the device, optionally allocating a zeroed one */
+struct page *pcd_buffer_page(struct pcdev_private_data *dev_data, unsigned long index, bool alloc) {
+
+    struct page *page, *old;
+
+    page = READ_ONCE(dev_data->pages[index]);
+    if (page || !alloc)
+        return page;
+
+    page = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+    if (!page)
+        return ERR_PTR(-ENOMEM);
+
+    /* Concurrent writers may fault in the same page, only one of them wins */
+    old = cmpxchg(&dev_data->pages[index], NULL, page);
+    if (old) {
+        __free_page(page);
+        page = old;
+    }
+
+    return page;
+}
+
+/* Resize the device buffer keeping the content which still fits, caller holds resize_lock for writing */
+int pcd_buffer_resize(struct pcdev_private_data *dev_data, int size) {
+
+    unsigned long i, nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+    struct page **pages = dev_data->pages;
+
+    /* Only a resize across a page boundary needs a new page array */
+    if (nr_pages != dev_data->nr_pages) {
+        pages = kvcalloc(nr_pages, sizeof(*pages), GFP_KERNEL);
+        if (!pages)
+            return -ENOMEM;
+
+        for (i = 0; i < min(nr_pages, dev_data->nr_pages); i++)
+            pages[i] = dev_data->pages[i];
+    }
+
+    /* Drop the pages beyond the new end, mappings keep their own reference */
+    for (i = nr_pages; i < dev_data->nr_pages; i++)
+        if (dev_data->pages[i])
+            put_page(dev_data->pages[i]);
+
+    /* Clear the cut off tail of the last page, so growing again reads back zeroes */
+    if ((size < dev_data->pdata.size) && offset_in_page(size) && pages[nr_pages - 1])
+        zero_user_segment(pages[nr_pages - 1], offset_in_page(size), PAGE_SIZE);
+
+    if (pages != dev_data->pages) {
+        kvfree(dev_data->pages);
+        dev_data->pages = pages;
+        dev_data->nr_pages = nr_pages;
+    }
+    dev_data->pdata.size = size;
+
+    return 0;
+}
+
+/* Take resize_lock for I/O, a nowait caller gives up while a resize runs */
+int pcd_resize_lock(struct pcdev_private_data *dev_data, bool nowait) {
+
+    u64 start;
+
+    if (down_read_trylock(&dev_data->resize_lock))
+        return 0;
+    if (nowait)
+        return -EAGAIN;
+
+    start = ktime_get_ns();
+    down_read(&dev_data->resize_lock);
+    pcd_stats_lock(dev_data->stats, start);
+
+    return 0;
+}
+
+/* Copy count bytes at pos into the iterator page by page, holes read back as zeroes */
+ssize_t pcd_buffer_read(struct pcdev_private_data *dev_data, struct iov_iter *to, size_t count, loff_t pos) {
+
+    size_t done = 0, chunk, copied;
+    unsigned long offset;
+    struct page *page;
+
+    while (done < count) {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - done);
+
+        page = pcd_buffer_page(dev_data, (pos + done) >> PAGE_SHIFT, false);
+        if (page)
+            copied = copy_page_to_iter(page, offset, chunk, to);
+        else
+            copied = iov_iter_zero(chunk, to);
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    return (done || !count) ? done : -EFAULT;
+}
+
+/* Copy count bytes from the iterator to pos, allocating the pages being written */
+ssize_t pcd_buffer_write(struct pcdev_private_data *dev_data, struct iov_iter *from, size_t count, loff_t pos, bool nowait) {
+
+    size_t done = 0, chunk, copied;
+    unsigned long offset;
+    struct page *page;
+
+    while (done < count) {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - done);
+
+        /* A nowait writer must not block in the page allocator */
+        page = pcd_buffer_page(dev_data, (pos + done) >> PAGE_SHIFT, !nowait);
+        if (IS_ERR_OR_NULL(page)) {
+            if (done)
+                break;
+            return page ? PTR_ERR(page) : -EAGAIN;
+        }
+
+        copied = copy_page_from_iter(page, offset, chunk, from);
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    return (done || !count) ? done : -EFAULT;
+}
+
 int check_permission(int permission, int access_mode){
 
     if (permission == RDWR)
@@ -145,6 +370,9 @@ int pcd_open(struct inode *inode, struct file *filp) {
     /* Supply device private data to other method of the driver */
     filp->private_data = pcdev_data;
 
+    /* Reads and writes honour IOCB_NOWAIT, so preadv2/pwritev2 may use RWF_NOWAIT */
+    filp->f_mode |= FMODE_NOWAIT;
+
     /* Check permission */
     ret = check_permission(pcdev_data->pdata.permission, filp->f_mode);
     if (!ret)
@@ -155,55 +383,87 @@ int pcd_open(struct inode *inode, struct file *filp) {
     return ret;
 }
 
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t *f_pos) {
+ssize_t pcd_read_iter(struct kiocb *iocb, struct iov_iter *to) {
 
     int max_size;
-    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+    ssize_t ret;
+    size_t count = iov_iter_count(to);
+    size_t requested = count;
+    loff_t pos = iocb->ki_pos;
+    /* Only read the clock when somebody listens to the tracepoint */
+    u64 start = trace_pcd_read_enabled() ? ktime_get_ns() : 0;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
+
+    ret = pcd_resize_lock(pcdev_data, iocb->ki_flags & IOCB_NOWAIT);
+    if (ret)
+        goto out;
+
     max_size = pcdev_data->pdata.size;
 
-    pr_info("Read requested for %zu bytes \n",count);
-    pr_info("Current file position = %lld\n",*f_pos);
+    /* Ajust the count argument, pread may start beyond the end of the device */
+    if (pos >= max_size)
+        count = 0;
+    else if ((pos + count) > max_size)
+        count = max_size - pos;
 
-    /* Ajust the count argument */
-    if ((*f_pos + count) > max_size)
-        count = max_size - *f_pos;
+    ret = pcd_buffer_read(pcdev_data, to, count, pos);
+    if (ret < 0)
+        goto unlock;
 
-    if (copy_to_user(buff, pcdev_data->buffer, count))
-        return -EFAULT;
-    
     /* Update current file position */
-    *f_pos += count;
-    pr_info("Number of bytes successfully read = %zu\n", count);
-    pr_info("Updated file position = %lld\n",*f_pos);
-
-    return count;
+    iocb->ki_pos += ret;
+
+unlock:
+    up_read(&pcdev_data->resize_lock);
+out:
+    pcd_stats_io(pcdev_data->stats, false, requested, ret);
+    trace_pcd_read(file_inode(iocb->ki_filp)->i_rdev, pos, requested, ret,
+                   start ? ktime_get_ns() - start : 0);
+    return ret;
 }
 
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos) {
+ssize_t pcd_write_iter(struct kiocb *iocb, struct iov_iter *from) {
 
     int max_size;
-    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
-    max_size = pcdev_data->pdata.size;
+    ssize_t ret;
+    size_t count = iov_iter_count(from);
+    size_t requested = count;
+    loff_t pos = iocb->ki_pos;
+    /* Only read the clock when somebody listens to the tracepoint */
+    u64 start = trace_pcd_write_enabled() ? ktime_get_ns() : 0;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
+
+    ret = pcd_resize_lock(pcdev_data, iocb->ki_flags & IOCB_NOWAIT);
+    if (ret)
+        goto out;
 
-    pr_info("Write requested %zu bytes \n",count);
-    pr_info("Current file position = %lld\n",*f_pos);
+    max_size = pcdev_data->pdata.size;
 
-    /* Ajust the count argument */
-    if ((*f_pos + count) > max_size)
-        count = max_size - *f_pos;
+    /* Ajust the count argument, pwrite may start beyond the end of the device */
+    if (pos >= max_size)
+        count = 0;
+    else if ((pos + count) > max_size)
+        count = max_size - pos;
 
-    if (!count)
-        return -ENOMEM;
+    if (!count) {
+        ret = -ENOMEM;
+        goto unlock;
+    }
 
-    if (copy_from_user(pcdev_data->buffer, buff, count))
-        return -EFAULT;
+    ret = pcd_buffer_write(pcdev_data, from, count, pos, iocb->ki_flags & IOCB_NOWAIT);
+    if (ret < 0)
+        goto unlock;
 
     /* Update current file position */
-    *f_pos += count;
-    pr_info("Number of bytes successfully written = %zu\n", count);
-    pr_info("Updated file position = %lld\n",*f_pos);
-
-    return count;
+    iocb->ki_pos += ret;
+
+unlock:
+    up_read(&pcdev_data->resize_lock);
+out:
+    pcd_stats_io(pcdev_data->stats, true, requested, ret);
+    trace_pcd_write(file_inode(iocb->ki_filp)->i_rdev, pos, requested, ret,
+                    start ? ktime_get_ns() - start : 0);
+    return ret;
 }
 
 loff_t pcd_lseek(struct file *filp, loff_t offset, int whence) {
@@ -235,10 +495,63 @@ loff_t pcd_lseek(struct file *filp, loff_t offset, int whence) {
             return -EINVAL;
     }
 
-    pr_info("New value of the file position = %lld\n",filp->f_pos);
+    trace_pcd_lseek(file_inode(filp)->i_rdev, offset, whence, filp->f_pos);
     return filp->f_pos;
 }
 
+int pcd_mmap(struct file *filp, struct vm_area_struct *vma) {
+
+    int ret = 0;
+    unsigned long i;
+    struct page *page;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+
+    /*
+     * Only shared mappings make sense, private ones would hide the device content. Test VM_MAYSHARE:
+     * mmap() clears VM_SHARED of a MAP_SHARED mapping of a file opened read only
+     */
+    if (!(vma->vm_flags & VM_MAYSHARE))
+        return -EINVAL;
+
+    /* A write only page can't be expressed by the MMU, so write only devices are never mapped */
+    if (pcdev_data->pdata.permission == WRONLY)
+        return -EPERM;
+
+    /* Read only device: refuse writable mappings and forbid a later mprotect(PROT_WRITE) */
+    if (pcdev_data->pdata.permission == RDONLY) {
+        if (vma->vm_flags & VM_WRITE)
+            return -EPERM;
+        vma->vm_flags &= ~VM_MAYWRITE;
+    }
+
+    down_read(&pcdev_data->resize_lock);
+
+    /* The mapping must stay inside the (page aligned) device buffer */
+    if ((vma->vm_pgoff >= pcdev_data->nr_pages) || (vma_pages(vma) > pcdev_data->nr_pages - vma->vm_pgoff)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* Populate the mapped range up front, so no fault handler is needed */
+    for (i = vma->vm_pgoff; i < vma->vm_pgoff + vma_pages(vma); i++) {
+        page = pcd_buffer_page(pcdev_data, i, true);
+        if (IS_ERR(page)) {
+            ret = PTR_ERR(page);
+            goto out;
+        }
+    }
+
+    /*
+     * No vm_operations keep a pointer to the device: the mapping only holds references
+     * on the buffer pages, so it stays valid after the device is removed or resized.
+     */
+    ret = vm_map_pages(vma, pcdev_data->pages, pcdev_data->nr_pages);
+
+out:
+    up_read(&pcdev_data->resize_lock);
+    return ret;
+}
+
 int pcd_release(struct inode *inode, struct file *filp) {
     pr_info("Released successful\n");
     return 0;
@@ -276,12 +589,129 @@ struct pcdev_platform_data* pcdev_check_pf_dt(struct device *dev) {
     return pdata;
 }
 
+/* Time the probe of one device and account it in the driver totals */
 int pcd_platform_driver_probe(struct platform_device *pdev) {
 
+    int ret;
+    u64 start, end, duration;
+
+    start = ktime_get_ns();
+    ret = pcd_probe_device(pdev);
+    end = ktime_get_ns();
+    duration = end - start;
+
+    mutex_lock(&pcdrv_data.lock);
+    pcdrv_data.probe_count++;
+    pcdrv_data.probe_total_ns += duration;
+    if (duration > pcdrv_data.probe_max_ns)
+        pcdrv_data.probe_max_ns = duration;
+    if (end > pcdrv_data.last_probe_ns)
+        pcdrv_data.last_probe_ns = end;
+    mutex_unlock(&pcdrv_data.lock);
+
+    dev_info(&pdev->dev, "Probe took %llu us (ret %d), %llu us since the driver was registered\n",
+             div_u64(duration, NSEC_PER_USEC), ret, div_u64(end - pcdrv_data.load_ns, NSEC_PER_USEC));
+
+    return ret;
+}
+
+/* Probe timing of every device so far, total is what a serial probe would have cost */
+int pcd_probe_show(struct seq_file *m, void *unused) {
+
+    mutex_lock(&pcdrv_data.lock);
+    seq_printf(m, "mode: %s\n", sync_probe ? "synchronous" : "asynchronous");
+    seq_printf(m, "probes: %d\n", pcdrv_data.probe_count);
+    seq_printf(m, "probe_total_us: %llu\n", div_u64(pcdrv_data.probe_total_ns, NSEC_PER_USEC));
+    seq_printf(m, "probe_max_us: %llu\n", div_u64(pcdrv_data.probe_max_ns, NSEC_PER_USEC));
+    seq_printf(m, "elapsed_us: %llu\n", pcdrv_data.probe_count ?
+               div_u64(pcdrv_data.last_probe_ns - pcdrv_data.load_ns, NSEC_PER_USEC) : 0);
+    mutex_unlock(&pcdrv_data.lock);
+
+    return 0;
+}
+
+/* An overlay applied at runtime changed a property: follow org,size of a bound device in place,
+ * its content and its open files stay, no unbind and rebind is needed */
+int pcd_of_notify(struct notifier_block *nb, unsigned long action, void *arg) {
+
+    int ret = 0, size, old_size;
+    u64 start, locked, end;
+    struct of_reconfig_data *rd = arg;
+    struct platform_device *pdev;
+    struct pcdev_private_data *dev_data;
+
+    if ((action != OF_RECONFIG_ADD_PROPERTY) && (action != OF_RECONFIG_UPDATE_PROPERTY))
+        return NOTIFY_DONE;
+    if (of_prop_cmp(rd->prop->name, "org,size") || (rd->prop->length != sizeof(__be32)))
+        return NOTIFY_DONE;
+
+    pdev = of_find_device_by_node(rd->dn);
+    if (!pdev)
+        return NOTIFY_DONE;
+
+    start = ktime_get_ns();
+    size = be32_to_cpup(rd->prop->value);
+
+    /* The device lock keeps remove away, only a device bound to this driver carries our data */
+    device_lock(&pdev->dev);
+    dev_data = (pdev->dev.driver == &pcd_platform_driver.driver) ? dev_get_drvdata(&pdev->dev) : NULL;
+    if (!dev_data || (size == dev_data->pdata.size))
+        goto unlock;
+
+    if (size <= 0) {
+        dev_info(&pdev->dev, "Ignoring org,size %d\n", size);
+        ret = -EINVAL;
+        goto unlock;
+    }
+
+    /* Waits for the I/O in flight, new I/O waits for the resize */
+    down_write(&dev_data->resize_lock);
+    locked = ktime_get_ns();
+    old_size = dev_data->pdata.size;
+    ret = pcd_buffer_resize(dev_data, size);
+    up_write(&dev_data->resize_lock);
+    end = ktime_get_ns();
+
+    if (ret) {
+        dev_info(&pdev->dev, "Cannot resize to %d bytes (%d), keeping %d\n", size, ret, old_size);
+        goto unlock;
+    }
+
+    mutex_lock(&pcdrv_data.lock);
+    pcdrv_data.resize_count++;
+    pcdrv_data.resize_total_ns += end - start;
+    if (end - start > pcdrv_data.resize_max_ns)
+        pcdrv_data.resize_max_ns = end - start;
+    mutex_unlock(&pcdrv_data.lock);
+
+    dev_info(&pdev->dev, "Resized from %d to %d bytes in %llu us (%llu us waiting for I/O)\n", old_size, size,
+             div_u64(end - start, NSEC_PER_USEC), div_u64(locked - start, NSEC_PER_USEC));
+
+unlock:
+    device_unlock(&pdev->dev);
+    put_device(&pdev->dev);
+    return ret ? notifier_from_errno(ret) : NOTIFY_OK;
+}
+
+/* Live resize timing of every device so far */
+int pcd_resize_show(struct seq_file *m, void *unused) {
+
+    mutex_lock(&pcdrv_data.lock);
+    seq_printf(m, "resizes: %d\n", pcdrv_data.resize_count);
+    seq_printf(m, "resize_total_us: %llu\n", div_u64(pcdrv_data.resize_total_ns, NSEC_PER_USEC));
+    seq_printf(m, "resize_max_us: %llu\n", div_u64(pcdrv_data.resize_max_ns, NSEC_PER_USEC));
+    mutex_unlock(&pcdrv_data.lock);
+
+    return 0;
+}
+
+int pcd_probe_device(struct platform_device *pdev) {
+
     int ret, driver_data;
     struct pcdev_private_data *dev_data;
     struct pcdev_platform_data *pdata;
     struct device *dev = &pdev->dev;
+    struct device *device_pcd;
     
     dev_info(dev, "Device was detected\n");
 
@@ -325,45 +755,87 @@ int pcd_platform_driver_probe(struct platform_device *pdev) {
     pr_info("Configure item 1: %d\n", pcdev_configure[driver_data].configure_num1);
     pr_info("Configure item 2: %d\n", pcdev_configure[driver_data].configure_num2);
 
-    /* Dynamically allocate memory for the device buffer */
-    dev_data->buffer = devm_kzalloc(dev, dev_data->pdata.size, GFP_KERNEL);
-    if (!dev_data->buffer) {
+    init_rwsem(&dev_data->resize_lock);
+
+    /* Only the page array is allocated here, pages are allocated on first access */
+    ret = pcd_buffer_init(dev_data);
+    if (ret) {
         dev_info(dev, "Cannot allocate memory\n");
+        return ret;
+    }
+
+    ret = devm_add_action_or_reset(dev, pcd_buffer_free, dev_data);
+    if (ret)
+        return ret;
+
+    dev_data->stats = pcd_stats_alloc();
+    if (!dev_data->stats)
         return -ENOMEM;
+
+    ret = devm_add_action_or_reset(dev, pcd_stats_free, dev_data->stats);
+    if (ret)
+        return ret;
+
+    /* Only the minor is reserved under the lock, the rest of the probe runs in parallel */
+    mutex_lock(&pcdrv_data.lock);
+    dev_data->minor = find_first_zero_bit(pcdrv_data.minors, NO_OF_DEVICES);
+    if (dev_data->minor < NO_OF_DEVICES) {
+        __set_bit(dev_data->minor, pcdrv_data.minors);
+        pcdrv_data.total_device++;
+    }
+    mutex_unlock(&pcdrv_data.lock);
+
+    if (dev_data->minor >= NO_OF_DEVICES) {
+        dev_info(dev, "No free minor number\n");
+        return -EBUSY;
     }
 
-    dev_data->dev_num = pcdrv_data.device_number_base + pcdrv_data.total_device;
+    dev_data->dev_num = pcdrv_data.device_number_base + dev_data->minor;
 
     cdev_init(&dev_data->cdev, &pcd_fops);
     dev_data->cdev.owner = THIS_MODULE;
     ret = cdev_add(&dev_data->cdev, dev_data->dev_num, 1);
     if (ret < 0) {
         dev_info(dev, "Cdev add failed\n");
-        return ret;
+        goto minor_free;
     }
 
     /* Create device file for the detected platform device */
-    pcdrv_data.device_pcd = device_create(pcdrv_data.class_pcd, dev, dev_data->dev_num, NULL, "pcdev-%d", pcdrv_data.total_device);
-    if (IS_ERR(pcdrv_data.device_pcd)) {
-        ret = PTR_ERR(pcdrv_data.device_pcd);
+    device_pcd = device_create(pcdrv_data.class_pcd, dev, dev_data->dev_num, NULL, "pcdev-%d", dev_data->minor);
+    if (IS_ERR(device_pcd)) {
+        ret = PTR_ERR(device_pcd);
         cdev_del(&dev_data->cdev);
-        return ret;
+        goto minor_free;
     }
 
-    pcdrv_data.total_device++;
+    /* Statistics are optional, the device works on without debugfs */
+    dev_data->debugfs = debugfs_create_dir(dev_name(device_pcd), pcdrv_data.debugfs_root);
+    debugfs_create_file("stats", S_IRUGO, dev_data->debugfs, dev_data->stats, &pcd_stats_fops);
 
     dev_info(dev, "Probe was successful\n");
     pr_info("--------------------\n");
     return 0;
+
+minor_free:
+    mutex_lock(&pcdrv_data.lock);
+    __clear_bit(dev_data->minor, pcdrv_data.minors);
+    pcdrv_data.total_device--;
+    mutex_unlock(&pcdrv_data.lock);
+    return ret;
 }
 
 int pcd_platform_driver_remove(struct platform_device *pdev) {
 
     struct pcdev_private_data *dev_data = dev_get_drvdata(&pdev->dev);
 
+    debugfs_remove_recursive(dev_data->debugfs);
     device_destroy(pcdrv_data.class_pcd, dev_data->dev_num);
     cdev_del(&dev_data->cdev);
+
+    mutex_lock(&pcdrv_data.lock);
+    __clear_bit(dev_data->minor, pcdrv_data.minors);
     pcdrv_data.total_device--;
+    mutex_unlock(&pcdrv_data.lock);
 
     dev_info(&pdev->dev, "Device was removed");
     return 0;
@@ -386,15 +858,29 @@ static int __init char_platform_driver_init(void) {
         goto unregister_allocate_dd;
     }
 
+    /* Every probed device adds its own directory below */
+    pcdrv_data.debugfs_root = debugfs_create_dir(CLASS_NAME, NULL);
+    debugfs_create_file("probe", S_IRUGO, pcdrv_data.debugfs_root, NULL, &pcd_probe_fops);
+    debugfs_create_file("resize", S_IRUGO, pcdrv_data.debugfs_root, NULL, &pcd_resize_fops);
+
+    if (sync_probe)
+        pcd_platform_driver.driver.probe_type = PROBE_FORCE_SYNCHRONOUS;
+
+    pcdrv_data.load_ns = ktime_get_ns();
     ret = platform_driver_register(&pcd_platform_driver);
     if (ret < 0)
         goto class_del;
 
+    /* Without CONFIG_OF_DYNAMIC the device tree never changes, the devices keep their probe size */
+    if (of_reconfig_notifier_register(&pcd_of_nb))
+        pr_info("No live resize, the device tree is static\n");
+
     pr_info("Platform driver module loaded\n");
 
     return 0;
 
 class_del:
+    debugfs_remove_recursive(pcdrv_data.debugfs_root);
     class_destroy(pcdrv_data.class_pcd);
     unregister_chrdev_region(pcdrv_data.device_number_base, NO_OF_DEVICES);
 unregister_allocate_dd:
@@ -405,7 +891,9 @@ error_out:
 }
 
 static void __exit char_platform_driver_exit(void) {
+    of_reconfig_notifier_unregister(&pcd_of_nb);
     platform_driver_unregister(&pcd_platform_driver);
+    debugfs_remove_recursive(pcdrv_data.debugfs_root);
     class_destroy(pcdrv_data.class_pcd);
     unregister_chrdev_region(pcdrv_data.device_number_base, NO_OF_DEVICES);
 
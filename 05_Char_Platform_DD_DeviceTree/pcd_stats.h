@@ -0,0 +1,159 @@
+/*
+ * @brief: Per-CPU I/O statistics of the pcd devices. Every CPU only touches its own counters,
+ *         they are folded together when <debugfs>/pcd_class/<device>/stats is read.
+ * @author: NghiaPham
+ * @ver: v0.1
+ * @date: 2020/12/20
+ *
+*/
+
+#ifndef PCD_STATS_H
+#define PCD_STATS_H
+
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+
+/* Counters of one device on one CPU */
+struct pcd_stats {
+    u64 read_ops;
+    u64 write_ops;
+    u64 read_bytes;
+    u64 write_bytes;
+    u64 short_reads;            /* Reads which returned less than requested */
+    u64 short_writes;
+    u64 efaults;                /* Copies to or from user space which faulted */
+    u64 lock_contended;         /* Lockers which found the device lock taken */
+    u64 lock_wait_ns;           /* Time the contended lockers waited */
+    struct u64_stats_sync syncp;    /* Lets 32-bit readers see whole 64-bit counters */
+};
+
+/* Allocate zeroed counters for every possible CPU */
+static inline struct pcd_stats __percpu *pcd_stats_alloc(void) {
+
+    int cpu;
+    struct pcd_stats __percpu *stats;
+
+    stats = alloc_percpu(struct pcd_stats);
+    if (!stats)
+        return NULL;
+
+    for_each_possible_cpu(cpu)
+        u64_stats_init(&per_cpu_ptr(stats, cpu)->syncp);
+
+    return stats;
+}
+
+/* Devres action which frees the counters */
+static inline void pcd_stats_free(void *data) {
+
+    free_percpu((struct pcd_stats __percpu *)data);
+}
+
+/* Account one read or write which asked for requested bytes and returned ret */
+static inline void pcd_stats_io(struct pcd_stats __percpu *stats, bool write, size_t requested, ssize_t ret) {
+
+    struct pcd_stats *s = get_cpu_ptr(stats);
+
+    u64_stats_update_begin(&s->syncp);
+    if (write) {
+        s->write_ops++;
+        if (ret > 0)
+            s->write_bytes += ret;
+        if ((ret >= 0) && (ret < requested))
+            s->short_writes++;
+    } else {
+        s->read_ops++;
+        if (ret > 0)
+            s->read_bytes += ret;
+        if ((ret >= 0) && (ret < requested))
+            s->short_reads++;
+    }
+    if (ret == -EFAULT)
+        s->efaults++;
+    u64_stats_update_end(&s->syncp);
+
+    put_cpu_ptr(stats);
+}
+
+/* Account a locker which found the lock taken at start and got past it now */
+static inline void pcd_stats_lock(struct pcd_stats __percpu *stats, u64 start) {
+
+    u64 wait = ktime_get_ns() - start;
+    struct pcd_stats *s = get_cpu_ptr(stats);
+
+    u64_stats_update_begin(&s->syncp);
+    s->lock_contended++;
+    s->lock_wait_ns += wait;
+    u64_stats_update_end(&s->syncp);
+
+    put_cpu_ptr(stats);
+}
+
+/* mutex_lock_interruptible() which accounts contention, an uncontended lock reads no clock */
+static inline int pcd_stats_mutex_lock(struct pcd_stats __percpu *stats, struct mutex *lock) {
+
+    int ret;
+    u64 start;
+
+    if (mutex_trylock(lock))
+        return 0;
+
+    start = ktime_get_ns();
+    ret = mutex_lock_interruptible(lock);
+    pcd_stats_lock(stats, start);
+
+    return ret;
+}
+
+/* Fold the counters of every CPU, a CPU updated meanwhile is read again */
+static inline void pcd_stats_sum(struct pcd_stats __percpu *stats, struct pcd_stats *sum) {
+
+    int cpu;
+    unsigned int seq;
+    struct pcd_stats *s, snap;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(stats, cpu);
+        do {
+            seq = u64_stats_fetch_begin(&s->syncp);
+            snap = *s;
+        } while (u64_stats_fetch_retry(&s->syncp, seq));
+
+        sum->read_ops += snap.read_ops;
+        sum->write_ops += snap.write_ops;
+        sum->read_bytes += snap.read_bytes;
+        sum->write_bytes += snap.write_bytes;
+        sum->short_reads += snap.short_reads;
+        sum->short_writes += snap.short_writes;
+        sum->efaults += snap.efaults;
+        sum->lock_contended += snap.lock_contended;
+        sum->lock_wait_ns += snap.lock_wait_ns;
+    }
+}
+
+/* The stats file of a device, its i_private are the per-CPU counters */
+static inline int pcd_stats_show(struct seq_file *m, void *unused) {
+
+    struct pcd_stats sum;
+
+    pcd_stats_sum(m->private, &sum);
+
+    seq_printf(m, "read_ops: %llu\n", sum.read_ops);
+    seq_printf(m, "write_ops: %llu\n", sum.write_ops);
+    seq_printf(m, "read_bytes: %llu\n", sum.read_bytes);
+    seq_printf(m, "write_bytes: %llu\n", sum.write_bytes);
+    seq_printf(m, "short_reads: %llu\n", sum.short_reads);
+    seq_printf(m, "short_writes: %llu\n", sum.short_writes);
+    seq_printf(m, "efaults: %llu\n", sum.efaults);
+    seq_printf(m, "lock_contended: %llu\n", sum.lock_contended);
+    seq_printf(m, "lock_wait_ns: %llu\n", sum.lock_wait_ns);
+
+    return 0;
+}
+
+#endif // PCD_STATS_H
@@ -0,0 +1,501 @@
+/*
+ * @brief: Page backed device buffer, pages are allocated on first access so large
+ *         devices don't need any high order allocation. Under memory pressure the
+ *         shrinker takes the pages of idle devices back, see pcd_buffer_reclaim()
+ * @author: NghiaPham
+ * @ver: v0.1
+ * @date: 2020/12/05
+ *
+*/
+
+#include "pcd_driver_dt_sysfs.h"
+
+/*
+ * Allocate a zeroed buffer page, the pool's reserve keeps writers going under memory pressure.
+ * Callers hold pcdev_lock and pages only return to the pool when buffers shrink, so the reserve
+ * is taken without waiting: an empty one fails with -ENOMEM instead of blocking the device.
+ */
+struct page *pcd_page_alloc(int node) {
+
+    struct page *page;
+
+    /* A device bound to a node tries there first, the pool is shared by every node */
+    if (node != NUMA_NO_NODE) {
+        page = alloc_pages_node(node, GFP_HIGHUSER | __GFP_ZERO | __GFP_THISNODE | __GFP_NOWARN, 0);
+        if (page)
+            return page;
+    }
+
+    page = alloc_page(GFP_HIGHUSER | __GFP_ZERO | __GFP_NOWARN);
+    if (page)
+        return page;
+
+    page = mempool_alloc(pcdrv_data.page_pool, GFP_NOWAIT | __GFP_NOWARN);
+    if (page)
+        clear_highpage(page);
+
+    return page;
+}
+
+/*
+ * Drop the buffer's reference of a page. Mappings and pipes hold references of their own and
+ * may drop them concurrently, so only whoever drops the last one owns the page: when that is
+ * the buffer, the page refills the pool, otherwise the last user frees it with its put_page().
+ */
+void pcd_page_free(struct page *page) {
+
+    if (page_ref_dec_and_test(page)) {
+        set_page_count(page, 1);
+        mempool_free(page, pcdrv_data.page_pool);
+    }
+}
+
+/* Allocate the page array of a device, the pages themselves are allocated on first use */
+int pcd_buffer_init(struct pcdev_private_data *dev_data) {
+
+    xa_init(&dev_data->spill);
+    dev_data->last_access = jiffies;
+    dev_data->nr_pages = DIV_ROUND_UP(dev_data->pdata.size, PAGE_SIZE);
+    /* The array is sized by power of two classes, resizes inside a class reuse it */
+    dev_data->max_pages = roundup_pow_of_two(dev_data->nr_pages);
+    dev_data->pages = kvcalloc(dev_data->max_pages, sizeof(*dev_data->pages), GFP_KERNEL);
+    if (!dev_data->pages)
+        return -ENOMEM;
+
+    return 0;
+}
+
+/* Allocate every page at probe, a flat buffer takes them from one physically contiguous block */
+int pcd_buffer_prealloc(struct pcdev_private_data *dev_data) {
+
+    unsigned long i;
+    unsigned int order;
+    struct page *page;
+
+    if (dev_data->pdata.flat) {
+        order = get_order(dev_data->nr_pages << PAGE_SHIFT);
+        page = alloc_pages_node(dev_data->node, GFP_HIGHUSER | __GFP_ZERO | __GFP_NOWARN, order);
+        if (page) {
+            /* Every page of the block is freed on its own later, the tail beyond the buffer right now */
+            split_page(page, order);
+            for (i = 0; i < (1UL << order); i++) {
+                if (i < dev_data->nr_pages)
+                    dev_data->pages[i] = page + i;
+                else
+                    __free_page(page + i);
+            }
+            atomic_long_add(dev_data->nr_pages, &dev_data->nr_resident);
+            return 0;
+        }
+        pr_info("No contiguous block of order %u, the buffer is built from single pages\n", order);
+    }
+
+    for (i = 0; i < dev_data->nr_pages; i++) {
+        page = pcd_buffer_page(dev_data, i, true);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+    }
+
+    return 0;
+}
+
+/* Point the page array at the reserved-memory carve out, no page is allocated for the buffer */
+int pcd_buffer_reserve(struct pcdev_private_data *dev_data) {
+
+    unsigned long i, pfn = PHYS_PFN(dev_data->pdata.reserved_base);
+
+    /* A no-map region has no struct page, it could be neither copied page-wise nor mapped */
+    for (i = 0; i < dev_data->nr_pages; i++)
+        if (!pfn_valid(pfn + i))
+            return -EINVAL;
+
+    for (i = 0; i < dev_data->nr_pages; i++) {
+        dev_data->pages[i] = pfn_to_page(pfn + i);
+        if (!dev_data->pdata.persistent)
+            clear_highpage(dev_data->pages[i]);
+    }
+
+    return 0;
+}
+
+/* Devres action, the buffer must outlive a firmware callback still in flight */
+void pcd_preload_wait(void *data) {
+
+    struct pcdev_private_data *dev_data = data;
+
+    wait_for_completion(&dev_data->loaded);
+}
+
+/* Fill the buffer with the firmware blob in the background, opens wait until it is done */
+int pcd_buffer_preload(struct pcdev_private_data *dev_data, struct device *dev) {
+
+    int ret;
+
+    init_completion(&dev_data->loaded);
+    if (!dev_data->pdata.firmware) {
+        complete_all(&dev_data->loaded);
+        return 0;
+    }
+
+    /* Registered before the request, so on remove it runs before the buffer is freed */
+    ret = devm_add_action(dev, pcd_preload_wait, dev_data);
+    if (ret)
+        return ret;
+
+    dev_data->preload_start = ktime_get_ns();
+    ret = request_firmware_nowait(THIS_MODULE, FW_ACTION_HOTPLUG, dev_data->pdata.firmware, dev,
+                                  GFP_KERNEL, dev_data, pcd_firmware_loaded);
+    if (ret) {
+        dev_info(dev, "Cannot request firmware %s (%d), the device starts empty\n", dev_data->pdata.firmware, ret);
+        complete_all(&dev_data->loaded);
+    }
+
+    return 0;
+}
+
+/* Firmware loader callback, a missing blob leaves the buffer empty but the device ready */
+void pcd_firmware_loaded(const struct firmware *fw, void *context) {
+
+    ssize_t ret = -ENOENT;
+    size_t len;
+    struct kvec kvec;
+    struct iov_iter iter;
+    struct pcdev_private_data *dev_data = context;
+
+    if (fw) {
+        mutex_lock(&dev_data->pcdev_lock);
+        len = min_t(size_t, fw->size, dev_data->pdata.size);
+        kvec.iov_base = (void *)fw->data;
+        kvec.iov_len = len;
+        iov_iter_kvec(&iter, WRITE, &kvec, 1, len);
+        ret = len ? pcd_buffer_write(dev_data, &iter, len, 0, false) : 0;
+        mutex_unlock(&dev_data->pcdev_lock);
+
+        if (fw->size > len)
+            pr_info("Firmware %s is %zu bytes, only %zu fit the device\n", dev_data->pdata.firmware, fw->size, len);
+        release_firmware(fw);
+    }
+
+    pr_info("Firmware %s: %zd, preload took %llu us\n", dev_data->pdata.firmware, ret,
+            div_u64(ktime_get_ns() - dev_data->preload_start, NSEC_PER_USEC));
+
+    complete_all(&dev_data->loaded);
+}
+
+/* Release every allocated page and the page array, from pcd_dev_release() on the last put */
+void pcd_buffer_free(void *data) {
+
+    unsigned long i;
+    struct pcd_spill *spill;
+    struct pcdev_private_data *dev_data = data;
+
+    /* Pages still mapped by user space keep their own reference until munmap, reserved ones aren't ours */
+    for (i = 0; i < dev_data->nr_pages; i++)
+        if (dev_data->pages[i] && !dev_data->pdata.reserved)
+            pcd_page_free(dev_data->pages[i]);
+
+    xa_for_each(&dev_data->spill, i, spill)
+        kfree(spill);
+    xa_destroy(&dev_data->spill);
+
+    kvfree(dev_data->pages);
+}
+
+/* Compress a page the shrinker takes away, an all zero page is simply dropped */
+int pcd_page_spill(struct pcdev_private_data *dev_data, unsigned long index, struct page *page) {
+
+    int ret;
+    void *src;
+    size_t len;
+    struct pcd_spill *spill;
+
+    src = kmap_atomic(page);
+    if (!memchr_inv(src, 0, PAGE_SIZE)) {
+        kunmap_atomic(src);
+        return 0;
+    }
+
+    ret = lzo1x_1_compress(src, PAGE_SIZE, pcdrv_data.reclaim_buf, &len, pcdrv_data.reclaim_wrkmem);
+    kunmap_atomic(src);
+
+    /* A page which hardly compresses stays resident, dropping it would gain too little */
+    if ((ret != LZO_E_OK) || (len > PAGE_SIZE / 2))
+        return -E2BIG;
+
+    /* Reclaim must not dip into the reserves it is trying to refill */
+    spill = kmalloc(struct_size(spill, data, len), GFP_NOWAIT | __GFP_NOWARN);
+    if (!spill)
+        return -ENOMEM;
+
+    spill->len = len;
+    memcpy(spill->data, pcdrv_data.reclaim_buf, len);
+
+    ret = xa_err(xa_store(&dev_data->spill, index, spill, GFP_NOWAIT | __GFP_NOWARN));
+    if (ret)
+        kfree(spill);
+
+    return ret;
+}
+
+/* Decompress a reclaimed page into a new page */
+int pcd_page_restore(struct page *page, struct pcd_spill *spill) {
+
+    int ret;
+    void *dst;
+    size_t len = PAGE_SIZE;
+
+    dst = kmap_atomic(page);
+    ret = lzo1x_decompress_safe(spill->data, spill->len, dst, &len);
+    kunmap_atomic(dst);
+
+    return ((ret == LZO_E_OK) && (len == PAGE_SIZE)) ? 0 : -EIO;
+}
+
+/* Take back up to nr pages of a device idle for reclaim_idle, pages mapped by user space stay */
+unsigned long pcd_buffer_reclaim(struct pcdev_private_data *dev_data, unsigned long nr) {
+
+    unsigned long i, freed = 0;
+    struct page *page;
+
+    /* Reclaim never waits for a device in use */
+    if (!mutex_trylock(&dev_data->pcdev_lock))
+        return 0;
+
+    if (time_before(jiffies, READ_ONCE(dev_data->last_access) + pcdrv_data.reclaim_idle))
+        goto out;
+
+    for (i = 0; (i < dev_data->nr_pages) && (freed < nr); i++) {
+        page = dev_data->pages[i];
+        if (!page || (page_count(page) != 1))
+            continue;
+
+        if (pcd_page_spill(dev_data, i, page))
+            continue;
+
+        /* Straight back to the page allocator, not into the driver's pool */
+        dev_data->pages[i] = NULL;
+        atomic_long_dec(&dev_data->nr_resident);
+        put_page(page);
+        freed++;
+    }
+
+out:
+    mutex_unlock(&dev_data->pcdev_lock);
+    return freed;
+}
+
+/* Take the next device of the registry from index on for the shrinker, frame devices have no pages
+ * and preallocated ones must stay resident */
+struct pcdev_private_data *pcd_reclaim_next(unsigned long *index) {
+
+    struct pcdev_private_data *dev_data;
+
+    xa_lock(&pcdrv_data.devices);
+    for (;;) {
+        dev_data = xa_find(&pcdrv_data.devices, index, ULONG_MAX, XA_PRESENT);
+        if (!dev_data || !(dev_data->pdata.frame || dev_data->pdata.prealloc))
+            break;
+        (*index)++;
+    }
+    if (dev_data)
+        kref_get(&dev_data->ref);
+    xa_unlock(&pcdrv_data.devices);
+
+    return dev_data;
+}
+
+/* Resident pages of the idle devices */
+unsigned long pcd_shrink_count(struct shrinker *shrinker, struct shrink_control *sc) {
+
+    unsigned long index, count = 0;
+    struct pcdev_private_data *dev_data;
+
+    if (!pcdrv_data.reclaim_idle)
+        return 0;
+
+    xa_lock(&pcdrv_data.devices);
+    xa_for_each(&pcdrv_data.devices, index, dev_data)
+        if (!dev_data->pdata.prealloc && time_after_eq(jiffies, READ_ONCE(dev_data->last_access) + pcdrv_data.reclaim_idle))
+            count += atomic_long_read(&dev_data->nr_resident);
+    xa_unlock(&pcdrv_data.devices);
+
+    return count ? count : SHRINK_EMPTY;
+}
+
+unsigned long pcd_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc) {
+
+    unsigned long index = 0, freed = 0;
+    struct pcdev_private_data *dev_data;
+
+    /* One compression buffer for the whole driver, a concurrent reclaimer already works on it */
+    if (!mutex_trylock(&pcdrv_data.reclaim_lock))
+        return SHRINK_STOP;
+
+    while ((freed < sc->nr_to_scan) && (dev_data = pcd_reclaim_next(&index))) {
+        freed += pcd_buffer_reclaim(dev_data, sc->nr_to_scan - freed);
+        pcd_dev_put(dev_data);
+        index++;
+    }
+
+    mutex_unlock(&pcdrv_data.reclaim_lock);
+
+    return freed;
+}
+
+/* Look up the page backing a page index of the device, optionally allocating a zeroed one */
+struct page *pcd_buffer_page(struct pcdev_private_data *dev_data, unsigned long index, bool alloc) {
+
+    struct page *page, *old;
+    struct pcd_spill *spill;
+
+    /* Every access goes through here, it tells the shrinker which devices are idle */
+    WRITE_ONCE(dev_data->last_access, jiffies);
+
+    page = READ_ONCE(dev_data->pages[index]);
+    if (page)
+        return page;
+
+    /* A reclaimed page comes back on any access, a hole is only filled by a write */
+    spill = xa_load(&dev_data->spill, index);
+    if (!spill && !alloc)
+        return NULL;
+
+    page = pcd_page_alloc(dev_data->node);
+    if (!page)
+        return ERR_PTR(-ENOMEM);
+
+    if (spill && pcd_page_restore(page, spill)) {
+        pcd_page_free(page);
+        return ERR_PTR(-EIO);
+    }
+
+    /* Concurrent writers may fault in the same page, only one of them wins */
+    old = cmpxchg(&dev_data->pages[index], NULL, page);
+    if (old) {
+        pcd_page_free(page);
+        return old;
+    }
+
+    if (spill)
+        kfree(xa_erase(&dev_data->spill, index));
+    atomic_long_inc(&dev_data->nr_resident);
+
+    return page;
+}
+
+/* Resize the device buffer keeping the content which still fits, caller holds pcdev_lock */
+int pcd_buffer_resize(struct pcdev_private_data *dev_data, int size) {
+
+    unsigned long i, nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+    unsigned long max_pages = roundup_pow_of_two(nr_pages);
+    struct page **pages = dev_data->pages;
+    struct page *page;
+
+    /* A reclaimed last page must come back before its cut off tail is cleared */
+    if ((size < dev_data->pdata.size) && offset_in_page(size)) {
+        page = pcd_buffer_page(dev_data, nr_pages - 1, false);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+    }
+
+    /* Only a resize into another size class needs a new page array */
+    if (max_pages != dev_data->max_pages) {
+        pages = kvcalloc(max_pages, sizeof(*pages), GFP_KERNEL);
+        if (!pages)
+            return -ENOMEM;
+
+        for (i = 0; i < min(nr_pages, dev_data->nr_pages); i++)
+            pages[i] = dev_data->pages[i];
+    }
+
+    /* Drop the pages beyond the new end, mappings keep their own reference */
+    for (i = nr_pages; i < dev_data->nr_pages; i++) {
+        if (dev_data->pages[i]) {
+            pcd_page_free(dev_data->pages[i]);
+            atomic_long_dec(&dev_data->nr_resident);
+        }
+        dev_data->pages[i] = NULL;
+        kfree(xa_erase(&dev_data->spill, i));
+    }
+
+    /* Clear the cut off tail of the last page, so growing again reads back zeroes */
+    if ((size < dev_data->pdata.size) && offset_in_page(size) && pages[nr_pages - 1])
+        zero_user_segment(pages[nr_pages - 1], offset_in_page(size), PAGE_SIZE);
+
+    if (pages != dev_data->pages) {
+        kvfree(dev_data->pages);
+        dev_data->pages = pages;
+        dev_data->max_pages = max_pages;
+    }
+    dev_data->nr_pages = nr_pages;
+    dev_data->pdata.size = size;
+
+    /* A preallocated device stays resident when it grows, pages it can't get now come on first access */
+    if (dev_data->pdata.prealloc)
+        for (i = 0; i < nr_pages; i++)
+            if (IS_ERR(pcd_buffer_page(dev_data, i, true)))
+                break;
+
+    return 0;
+}
+
+/* Copy count bytes at pos into the iterator page by page, holes read back as zeroes */
+ssize_t pcd_buffer_read(struct pcdev_private_data *dev_data, struct iov_iter *to, size_t count, loff_t pos) {
+
+    size_t done = 0, chunk, copied;
+    unsigned long offset;
+    struct page *page;
+
+    while (done < count) {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - done);
+
+        page = pcd_buffer_page(dev_data, (pos + done) >> PAGE_SHIFT, false);
+        /* A reclaimed page which can't come back ends the read */
+        if (IS_ERR(page))
+            return done ? done : PTR_ERR(page);
+        if (page)
+            copied = copy_page_to_iter(page, offset, chunk, to);
+        else
+            copied = iov_iter_zero(chunk, to);
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    return (done || !count) ? done : -EFAULT;
+}
+
+/* Copy count bytes from the iterator to pos, allocating the pages being written */
+ssize_t pcd_buffer_write(struct pcdev_private_data *dev_data, struct iov_iter *from, size_t count, loff_t pos, bool nowait) {
+
+    size_t done = 0, chunk, copied;
+    unsigned long offset;
+    struct page *page;
+
+    while (done < count) {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - done);
+
+        /* A nowait writer must not block in the page allocator */
+        page = pcd_buffer_page(dev_data, (pos + done) >> PAGE_SHIFT, !nowait);
+        if (IS_ERR_OR_NULL(page)) {
+            if (done)
+                break;
+            return page ? PTR_ERR(page) : -EAGAIN;
+        }
+
+        copied = copy_page_from_iter(page, offset, chunk, from);
+
+        /* Write-back mode: the page reaches the backing file later */
+        if (copied && dev_data->wb_dirty)
+            pcd_wb_mark(dev_data, (pos + done) >> PAGE_SHIFT);
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    return (done || !count) ? done : -EFAULT;
+}
@@ -34,7 +34,38 @@ struct of_device_id org_pcdev_dt_match[] = {
     {}
 };
 
-struct pcdrv_private_data pcdrv_data;
+struct pcdrv_private_data pcdrv_data = {
+    .total_device = ATOMIC_INIT(0),
+    .minor_ida = IDA_INIT(pcdrv_data.minor_ida),
+    .devices = XARRAY_INIT(pcdrv_data.devices, 0),
+    .lock = __MUTEX_INITIALIZER(pcdrv_data.lock),
+    .reclaim_lock = __MUTEX_INITIALIZER(pcdrv_data.reclaim_lock),
+};
+
+/* Probe in the caller's context instead of the async domain, to measure what async probing saves */
+static bool sync_probe;
+module_param(sync_probe, bool, S_IRUGO);
+MODULE_PARM_DESC(sync_probe, "Probe the devices synchronously (default: asynchronously)");
+
+/* Buffer pages the pool keeps in reserve for all devices together */
+static int pool_pages = 64;
+module_param(pool_pages, int, S_IRUGO);
+MODULE_PARM_DESC(pool_pages, "Reserved buffer pages shared by the devices (default: 64)");
+
+/* Buffers untouched for this long are given back under memory pressure */
+static unsigned int reclaim_idle = 60;
+module_param(reclaim_idle, uint, S_IRUGO);
+MODULE_PARM_DESC(reclaim_idle, "Seconds without access before the shrinker reclaims a buffer, 0 = never (default: 60)");
+
+/* How long written pages of a write-back device may stay dirty */
+static unsigned int writeback_ms = 5000;
+module_param(writeback_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(writeback_ms, "Milliseconds before dirty pages are written to the backing file (default: 5000)");
+
+/* Give every device the generic fops, to measure what the specialized ones save */
+static bool generic_fops;
+module_param(generic_fops, bool, S_IRUGO);
+MODULE_PARM_DESC(generic_fops, "Use the generic file operations for every device (default: per variant)");
 
 /* Create two custom attributes of a device. */
 static DEVICE_ATTR(max_size, S_IRUGO | S_IWUSR, max_size_show, max_size_store);
@@ -53,13 +84,67 @@ struct attribute_group pcd_attr_group = {
 
 struct file_operations pcd_fops = {
     .open = pcd_open,
-    .write = pcd_write,
-    .read = pcd_read,
+    .write_iter = pcd_write_iter,
+    .read_iter = pcd_read_iter,
     .release = pcd_release,
     .llseek = pcd_lseek,
+    .mmap = pcd_mmap,
+    .fsync = pcd_fsync,
+    /* splice/sendfile run through read_iter/write_iter, device pages are handed to the pipe by reference */
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+    .poll = pcd_poll,
     .owner = THIS_MODULE
 };
 
+/* Buffer device fops picked at probe, the hot path doesn't test the mode or the permission */
+struct file_operations pcd_rdwr_fops = {
+    .open = pcd_open_rdwr,
+    .write_iter = pcd_buffer_write_iter,
+    .read_iter = pcd_buffer_read_iter,
+    .release = pcd_release,
+    .llseek = pcd_lseek,
+    .mmap = pcd_mmap,
+    .fsync = pcd_fsync,
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+    .owner = THIS_MODULE
+};
+
+struct file_operations pcd_rdonly_fops = {
+    .open = pcd_open_rdonly,
+    .read_iter = pcd_buffer_read_iter,
+    .release = pcd_release,
+    .llseek = pcd_lseek,
+    .mmap = pcd_mmap,
+    .splice_read = generic_file_splice_read,
+    .owner = THIS_MODULE
+};
+
+/* A write only page can't be mapped, so there is no mmap either */
+struct file_operations pcd_wronly_fops = {
+    .open = pcd_open_wronly,
+    .write_iter = pcd_buffer_write_iter,
+    .release = pcd_release,
+    .llseek = pcd_lseek,
+    .fsync = pcd_fsync,
+    .splice_write = iter_file_splice_write,
+    .owner = THIS_MODULE
+};
+
+/* Reclaims the pages of idle devices, see pcd_buffer.c */
+struct shrinker pcd_shrinker = {
+    .count_objects = pcd_shrink_count,
+    .scan_objects = pcd_shrink_scan,
+    .seeks = DEFAULT_SEEKS
+};
+
+/* Read only <debugfs>/pcd_class/pcdev-N/stats, see pcd_stats.h */
+DEFINE_SHOW_ATTRIBUTE(pcd_stats);
+
+/* Read only <debugfs>/pcd_class/probe, how long probing the devices took */
+DEFINE_SHOW_ATTRIBUTE(pcd_probe);
+
 struct platform_driver pcd_platform_driver = {
     .probe = pcd_platform_driver_probe,
     .remove = pcd_platform_driver_remove,
@@ -68,7 +153,9 @@ struct platform_driver pcd_platform_driver = {
     /* fall-back to driver name match */
     .driver = {
         .name = "pseudo-char-device",
-        .of_match_table = org_pcdev_dt_match
+        .of_match_table = org_pcdev_dt_match,
+        /* Devices are independent of each other, probe them in parallel off the boot path */
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS
     }
 };
 
@@ -88,10 +175,31 @@ ssize_t max_size_store(struct device *dev, struct device_attribute *attr, const
     ret = kstrtol(buf, 10, &result);
     if (ret)
         return ret;
-    
-    dev_data->pdata.size = result;
-    dev_data->buffer = krealloc(dev_data->buffer, dev_data->pdata.size, GFP_KERNEL);
-	return count;
+
+    if ((result <= 0) || (result > INT_MAX))
+        return -EINVAL;
+
+    /* Only the page array is reallocated, the pages which still fit are kept */
+    mutex_lock(&dev_data->pcdev_lock);
+    if (dev_data->pdata.fifo && dev_data->fifo_len) {
+        /* The ring layout depends on the size, only an empty FIFO can be resized */
+        ret = -EBUSY;
+    } else if (dev_data->pdata.reserved || dev_data->pdata.backing_file) {
+        /* The buffer is fixed to its reserved-memory carve out or mirrors its backing file */
+        ret = -EBUSY;
+    } else if (dev_data->pdata.frame) {
+        /* Frames don't use the page array, readers switch to the resized frame */
+        ret = pcd_frame_resize(dev_data, result);
+    } else {
+        ret = pcd_buffer_resize(dev_data, result);
+        if (!ret && dev_data->pdata.fifo)
+            pcd_fifo_reset(dev_data);
+    }
+    mutex_unlock(&dev_data->pcdev_lock);
+    if (ret)
+        return ret;
+
+    return count;
 }
 
 ssize_t serial_number_show(struct device *dev, struct device_attribute *attr, char *buf) {
@@ -100,9 +208,49 @@ ssize_t serial_number_show(struct device *dev, struct device_attribute *attr, ch
     return scnprintf(buf, PAGE_SIZE, "%s\n", dev_data->pdata.serial_number);
 }
 
+/* Carve the buffer out of the reserved-memory region the node's memory-region refers to */
+int pcdev_check_reserved_mem(struct device *dev, struct pcdev_platform_data *pdata) {
+
+    u32 offset = 0;
+    bool reusable;
+    struct reserved_mem *rmem;
+    struct device_node *rmem_node;
+
+    rmem_node = of_parse_phandle(dev->of_node, "memory-region", 0);
+    if (!rmem_node)
+        return 0;
+
+    rmem = of_reserved_mem_lookup(rmem_node);
+    /* A reusable (CMA) region belongs to the page allocator until someone claims it */
+    reusable = of_property_read_bool(rmem_node, "reusable");
+    of_node_put(rmem_node);
+    if (!rmem || reusable) {
+        dev_info(dev, "The memory-region is not a static reserved-memory region\n");
+        return -EINVAL;
+    }
+
+    /* Several devices may share a region, each one at its own offset */
+    of_property_read_u32(dev->of_node, "org,memory-offset", &offset);
+    if (!PAGE_ALIGNED(rmem->base + offset) || (offset + PAGE_ALIGN(pdata->size) > rmem->size)) {
+        dev_info(dev, "Buffer doesn't fit page aligned into the memory-region\n");
+        return -EINVAL;
+    }
+
+    pdata->reserved = true;
+    pdata->reserved_base = rmem->base + offset;
+    pdata->persistent = of_property_read_bool(dev->of_node, "org,memory-persistent");
+    /* The carve out is always resident, the shrinker has nothing to take */
+    pdata->prealloc = true;
+
+    return 0;
+}
+
 /* This function check device from device tree or setup code */
 struct pcdev_platform_data* pcdev_check_pf_dt(struct device *dev) {
 
+    u32 node;
+    int ret;
+    const char *value;
     struct device_node *dev_node = dev->of_node;
     struct pcdev_platform_data *pdata;
 
@@ -129,7 +277,74 @@ struct pcdev_platform_data* pcdev_check_pf_dt(struct device *dev) {
         dev_info(dev, "Missing permission property\n");
         return ERR_PTR(-EINVAL);
     }
-    
+
+    /* Optional FIFO mode, the thresholds default to 1 byte */
+    pdata->fifo = of_property_read_bool(dev_node, "org,fifo-mode");
+    of_property_read_u32(dev_node, "org,fifo-rd-threshold", &pdata->fifo_rd_threshold);
+    of_property_read_u32(dev_node, "org,fifo-wr-threshold", &pdata->fifo_wr_threshold);
+
+    /* Optional frame mode */
+    pdata->frame = of_property_read_bool(dev_node, "org,frame-mode");
+
+    /* Optional tuning: backing type, locking mode, allocation policy and NUMA node */
+    if (!of_property_read_string(dev_node, "org,backing", &value)) {
+        if (!strcmp(value, "ring")) {
+            pdata->fifo = true;
+        } else if (!strcmp(value, "frame")) {
+            pdata->frame = true;
+        } else if (!strcmp(value, "flat")) {
+            pdata->flat = true;
+            pdata->prealloc = true;
+        } else if (strcmp(value, "paged")) {
+            dev_info(dev, "Unknown backing %s\n", value);
+            return ERR_PTR(-EINVAL);
+        }
+    }
+
+    if (!of_property_read_string(dev_node, "org,lock-mode", &value)) {
+        if (!strcmp(value, "trylock")) {
+            pdata->lock_trylock = true;
+        } else if (strcmp(value, "mutex")) {
+            dev_info(dev, "Unknown lock mode %s\n", value);
+            return ERR_PTR(-EINVAL);
+        }
+    }
+
+    if (of_property_read_bool(dev_node, "org,prealloc"))
+        pdata->prealloc = true;
+
+    /* The device data and the buffer pages are allocated on the node of the device */
+    if (!of_property_read_u32(dev_node, "org,numa-node", &node)) {
+        if ((node >= MAX_NUMNODES) || !node_online(node)) {
+            dev_info(dev, "NUMA node %u is not online\n", node);
+            return ERR_PTR(-EINVAL);
+        }
+        set_dev_node(dev, node);
+    }
+
+    ret = pcdev_check_reserved_mem(dev, pdata);
+    if (ret)
+        return ERR_PTR(ret);
+
+    /* Optional calibration blob, loaded in the background so probe doesn't wait for the filesystem */
+    of_property_read_string(dev_node, "org,preload-firmware", &pdata->firmware);
+    if (pdata->firmware && (pdata->fifo || pdata->frame)) {
+        dev_info(dev, "Only a buffer device can be preloaded\n");
+        return ERR_PTR(-EINVAL);
+    }
+
+    /* Optional write-back mode, the buffer caches a file and survives a module reload */
+    of_property_read_string(dev_node, "org,backing-file", &pdata->backing_file);
+    if (pdata->backing_file && (pdata->fifo || pdata->frame || pdata->reserved || pdata->firmware)) {
+        dev_info(dev, "A backing file only goes with a plain buffer device\n");
+        return ERR_PTR(-EINVAL);
+    }
+
+    if (pdata->reserved && (pdata->frame || pdata->flat)) {
+        dev_info(dev, "A memory-region buffer can't be in frame or flat mode\n");
+        return ERR_PTR(-EINVAL);
+    }
+
     return pdata;
 }
 
@@ -153,12 +368,119 @@ int pcd_sysfs_create(struct device *dev) {
     return 0;
 }
 
+/* Look up the device of a minor and take a reference, NULL once the device is removed */
+struct pcdev_private_data *pcd_dev_get(int minor) {
+
+    struct pcdev_private_data *dev_data;
+
+    xa_lock(&pcdrv_data.devices);
+    dev_data = xa_load(&pcdrv_data.devices, minor);
+    if (dev_data)
+        kref_get(&dev_data->ref);
+    xa_unlock(&pcdrv_data.devices);
+
+    return dev_data;
+}
+
+/* Last reference is gone, neither the platform device nor an open file uses the data */
+void pcd_dev_release(struct kref *ref) {
+
+    struct pcdev_private_data *dev_data = container_of(ref, struct pcdev_private_data, ref);
+
+    if (dev_data->pages)
+        pcd_buffer_free(dev_data);
+    pcd_frame_free(dev_data);
+    kvfree(dev_data->wb_dirty);
+    kfree(dev_data->wb_buf);
+    pcd_stats_free(dev_data->stats);
+    kmem_cache_free(pcdrv_data.dev_cache, dev_data);
+}
+
+/* Devres action which drops the reference of the bound device */
+void pcd_dev_put(void *data) {
+
+    struct pcdev_private_data *dev_data = data;
+
+    kref_put(&dev_data->ref, pcd_dev_release);
+}
+
+/* Devres action which unpublishes the device and gives its minor back */
+void pcd_minor_free(void *data) {
+
+    struct pcdev_private_data *dev_data = data;
+
+    xa_erase(&pcdrv_data.devices, dev_data->minor);
+    ida_free(&pcdrv_data.minor_ida, dev_data->minor);
+}
+
+/* Choose the file operations of a device from its mode and permission */
+const struct file_operations *pcd_select_fops(struct pcdev_platform_data *pdata) {
+
+    /* FIFO and frame devices have their own read and write paths */
+    if (generic_fops || pdata->fifo || pdata->frame)
+        return &pcd_fops;
+
+    switch (pdata->permission) {
+        case RDONLY:
+            return &pcd_rdonly_fops;
+        case WRONLY:
+            return &pcd_wronly_fops;
+        case RDWR:
+            return &pcd_rdwr_fops;
+        default:
+            return &pcd_fops;
+    }
+}
+
+/* Time the probe of one device and account it in the driver totals */
 int pcd_platform_driver_probe(struct platform_device *pdev) {
 
+    int ret;
+    u64 start, end, duration;
+
+    start = ktime_get_ns();
+    ret = pcd_probe_device(pdev);
+    end = ktime_get_ns();
+    duration = end - start;
+
+    mutex_lock(&pcdrv_data.lock);
+    pcdrv_data.probe_count++;
+    pcdrv_data.probe_total_ns += duration;
+    if (duration > pcdrv_data.probe_max_ns)
+        pcdrv_data.probe_max_ns = duration;
+    if (end > pcdrv_data.last_probe_ns)
+        pcdrv_data.last_probe_ns = end;
+    mutex_unlock(&pcdrv_data.lock);
+
+    dev_info(&pdev->dev, "Probe took %llu us (ret %d), %llu us since the driver was registered\n",
+             div_u64(duration, NSEC_PER_USEC), ret, div_u64(end - pcdrv_data.load_ns, NSEC_PER_USEC));
+
+    return ret;
+}
+
+/* Probe timing of every device so far, total is what a serial probe would have cost */
+int pcd_probe_show(struct seq_file *m, void *unused) {
+
+    mutex_lock(&pcdrv_data.lock);
+    seq_printf(m, "mode: %s\n", sync_probe ? "synchronous" : "asynchronous");
+    seq_printf(m, "devices: %d\n", atomic_read(&pcdrv_data.total_device));
+    seq_printf(m, "probes: %d\n", pcdrv_data.probe_count);
+    seq_printf(m, "probe_total_us: %llu\n", div_u64(pcdrv_data.probe_total_ns, NSEC_PER_USEC));
+    seq_printf(m, "probe_max_us: %llu\n", div_u64(pcdrv_data.probe_max_ns, NSEC_PER_USEC));
+    seq_printf(m, "elapsed_us: %llu\n", pcdrv_data.probe_count ?
+               div_u64(pcdrv_data.last_probe_ns - pcdrv_data.load_ns, NSEC_PER_USEC) : 0);
+    mutex_unlock(&pcdrv_data.lock);
+
+    return 0;
+}
+
+int pcd_probe_device(struct platform_device *pdev) {
+
     int ret, driver_data;
     struct pcdev_private_data *dev_data;
     struct pcdev_platform_data *pdata;
     struct device *dev = &pdev->dev;
+    struct device *device_pcd;
     
     dev_info(dev, "Device was detected\n");
 
@@ -181,19 +503,42 @@ int pcd_platform_driver_probe(struct platform_device *pdev) {
         driver_data = (int) of_device_get_match_data(dev);
     }
 
-    /* Dynamically allocate memory for the device private data */
-    dev_data = devm_kzalloc(dev, sizeof(*dev_data), GFP_KERNEL);
+    /* Open files keep the device private data alive after a remove, so it is refcounted instead of devm */
+    dev_data = kmem_cache_alloc_node(pcdrv_data.dev_cache, GFP_KERNEL | __GFP_ZERO, dev_to_node(dev));
     if (!dev_data) {
         dev_info(dev, "Cannot allocate memory\n");
         return -ENOMEM;
     }
 
+    kref_init(&dev_data->ref);
+    ret = devm_add_action_or_reset(dev, pcd_dev_put, dev_data);
+    if (ret)
+        return ret;
+
     /* Save device private data pointer in platform device structure (release)*/
     dev_set_drvdata(dev, dev_data);
 
     dev_data->pdata.size = pdata->size;
     dev_data->pdata.permission = pdata->permission;
     dev_data->pdata.serial_number = pdata->serial_number;
+    dev_data->pdata.fifo = pdata->fifo;
+    dev_data->pdata.fifo_rd_threshold = pdata->fifo_rd_threshold;
+    dev_data->pdata.fifo_wr_threshold = pdata->fifo_wr_threshold;
+    dev_data->pdata.frame = pdata->frame;
+    dev_data->pdata.flat = pdata->flat;
+    dev_data->pdata.prealloc = pdata->prealloc;
+    dev_data->pdata.lock_trylock = pdata->lock_trylock;
+    dev_data->pdata.reserved = pdata->reserved;
+    dev_data->pdata.reserved_base = pdata->reserved_base;
+    dev_data->pdata.persistent = pdata->persistent;
+    dev_data->pdata.firmware = pdata->firmware;
+    dev_data->pdata.backing_file = pdata->backing_file;
+    dev_data->node = dev_to_node(dev);
+
+    if (dev_data->pdata.fifo && dev_data->pdata.frame) {
+        dev_info(dev, "A device can't be in FIFO and frame mode at once\n");
+        return -EINVAL;
+    }
 
     pr_info("Device size %d\n", dev_data->pdata.size);
     pr_info("Device permission %d\n", dev_data->pdata.permission);
@@ -202,39 +547,109 @@ int pcd_platform_driver_probe(struct platform_device *pdev) {
     pr_info("Configure item 1: %d\n", pcdev_configure[driver_data].configure_num1);
     pr_info("Configure item 2: %d\n", pcdev_configure[driver_data].configure_num2);
 
-    /* Dynamically allocate memory for the device buffer */
-    dev_data->buffer = devm_kzalloc(dev, dev_data->pdata.size, GFP_KERNEL);
-    if (!dev_data->buffer) {
+    mutex_init(&dev_data->pcdev_lock);
+
+    /* Only the page array is allocated here, pages are allocated on first access */
+    ret = pcd_buffer_init(dev_data);
+    if (ret) {
         dev_info(dev, "Cannot allocate memory\n");
+        return ret;
+    }
+
+    /* A reserved-memory buffer is ready at probe, nothing to allocate */
+    if (dev_data->pdata.reserved) {
+        ret = pcd_buffer_reserve(dev_data);
+        if (ret) {
+            dev_info(dev, "The memory-region has no struct pages (no-map?)\n");
+            return ret;
+        }
+        dev_info(dev, "Buffer at %pa%s\n", &dev_data->pdata.reserved_base,
+                 dev_data->pdata.persistent ? ", content kept" : "");
+    } else if (dev_data->pdata.prealloc && !dev_data->pdata.frame) {
+        /* Frame devices keep their content in frames, not in the page array */
+        ret = pcd_buffer_prealloc(dev_data);
+        if (ret) {
+            dev_info(dev, "Cannot preallocate the buffer\n");
+            return ret;
+        }
+    }
+
+    dev_data->stats = pcd_stats_alloc();
+    if (!dev_data->stats)
         return -ENOMEM;
+
+    pcd_fifo_init(dev_data);
+
+    ret = pcd_frame_init(dev_data);
+    if (ret) {
+        dev_info(dev, "Cannot allocate memory\n");
+        return ret;
+    }
+
+    /* Write-back mode: the buffer gets the content of the backing file on the first open */
+    ret = pcd_wb_init(dev_data, dev);
+    if (ret)
+        return ret;
+
+    /* Opens wait on the preload, so it is set up before the device is published */
+    ret = pcd_buffer_preload(dev_data, dev);
+    if (ret)
+        return ret;
+
+    /* A removed device gives its minor back, so the region never runs out while devices come and go */
+    dev_data->minor = ida_alloc_max(&pcdrv_data.minor_ida, PCD_MAX_DEVICES - 1, GFP_KERNEL);
+    if (dev_data->minor < 0) {
+        dev_info(dev, "No free minor number\n");
+        return dev_data->minor;
     }
 
-    dev_data->dev_num = pcdrv_data.device_number_base + pcdrv_data.total_device;
+    /* Publish the device for pcd_open() before its cdev goes live */
+    ret = xa_insert(&pcdrv_data.devices, dev_data->minor, dev_data, GFP_KERNEL);
+    if (ret) {
+        ida_free(&pcdrv_data.minor_ida, dev_data->minor);
+        return ret;
+    }
+
+    ret = devm_add_action_or_reset(dev, pcd_minor_free, dev_data);
+    if (ret)
+        return ret;
+
+    dev_data->dev_num = pcdrv_data.device_number_base + dev_data->minor;
+
+    dev_data->cdev = cdev_alloc();
+    if (!dev_data->cdev)
+        return -ENOMEM;
 
-    cdev_init(&dev_data->cdev, &pcd_fops);
-    dev_data->cdev.owner = THIS_MODULE;
-    ret = cdev_add(&dev_data->cdev, dev_data->dev_num, 1);
+    dev_data->cdev->ops = pcd_select_fops(&dev_data->pdata);
+    dev_data->cdev->owner = THIS_MODULE;
+    ret = cdev_add(dev_data->cdev, dev_data->dev_num, 1);
     if (ret < 0) {
         dev_info(dev, "Cdev add failed\n");
+        kobject_put(&dev_data->cdev->kobj);
         return ret;
     }
 
     /* Create device file for the detected platform device */
-    pcdrv_data.device_pcd = device_create(pcdrv_data.class_pcd, dev, dev_data->dev_num, NULL, "pcdev-%d", pcdrv_data.total_device);
-    if (IS_ERR(pcdrv_data.device_pcd)) {
-        ret = PTR_ERR(pcdrv_data.device_pcd);
-        cdev_del(&dev_data->cdev);
+    device_pcd = device_create(pcdrv_data.class_pcd, dev, dev_data->dev_num, NULL, "pcdev-%d", dev_data->minor);
+    if (IS_ERR(device_pcd)) {
+        ret = PTR_ERR(device_pcd);
+        cdev_del(dev_data->cdev);
         return ret;
     }
 
-    pcdrv_data.total_device++;
-
-    ret = pcd_sysfs_create(pcdrv_data.device_pcd);
+    ret = pcd_sysfs_create(device_pcd);
     if (ret){
         device_destroy(pcdrv_data.class_pcd, dev_data->dev_num);
+        cdev_del(dev_data->cdev);
         return ret;
     }
 
+    atomic_inc(&pcdrv_data.total_device);
+
+    /* Statistics are optional, the device works on without debugfs */
+    dev_data->debugfs = debugfs_create_dir(dev_name(device_pcd), pcdrv_data.debugfs_root);
+    debugfs_create_file("stats", S_IRUGO, dev_data->debugfs, dev_data->stats, &pcd_stats_fops);
+
     dev_info(dev, "Probe was successful\n");
     pr_info("--------------------\n");
     return 0;
@@ -244,9 +659,10 @@ int pcd_platform_driver_remove(struct platform_device *pdev) {
 
     struct pcdev_private_data *dev_data = dev_get_drvdata(&pdev->dev);
 
+    debugfs_remove_recursive(dev_data->debugfs);
     device_destroy(pcdrv_data.class_pcd, dev_data->dev_num);
-    cdev_del(&dev_data->cdev);
-    pcdrv_data.total_device--;
+    cdev_del(dev_data->cdev);
+    atomic_dec(&pcdrv_data.total_device);
 
     dev_info(&pdev->dev, "Device was removed");
     return 0;
@@ -256,18 +672,52 @@ static int __init char_platform_driver_init(void) {
 
     int ret;
 
-    /* Dynamically allocate a device number <one device> */
-    ret = alloc_chrdev_region(&pcdrv_data.device_number_base, 0, NO_OF_DEVICES, DEV_NAME);
+    /* Dynamically allocate the whole minor space, probe hands out minors from it */
+    ret = alloc_chrdev_region(&pcdrv_data.device_number_base, 0, PCD_MAX_DEVICES, DEV_NAME);
     if (ret < 0)
         goto error_out;
 
+    /* Device private data comes from its own slab, create/remove churn doesn't fragment kmalloc caches */
+    pcdrv_data.dev_cache = KMEM_CACHE(pcdev_private_data, SLAB_HWCACHE_ALIGN);
+    if (!pcdrv_data.dev_cache) {
+        ret = -ENOMEM;
+        goto unregister_allocate_dd;
+    }
+
+    pcdrv_data.page_pool = mempool_create_page_pool(max(pool_pages, 1), 0);
+    if (!pcdrv_data.page_pool) {
+        ret = -ENOMEM;
+        goto cache_destroy;
+    }
+
+    pcdrv_data.reclaim_idle = (unsigned long)reclaim_idle * HZ;
+    pcdrv_data.wb_interval = msecs_to_jiffies(writeback_ms);
+    pcdrv_data.reclaim_wrkmem = kmalloc(LZO1X_1_MEM_COMPRESS, GFP_KERNEL);
+    pcdrv_data.reclaim_buf = kmalloc(lzo1x_worst_compress(PAGE_SIZE), GFP_KERNEL);
+    if (!pcdrv_data.reclaim_wrkmem || !pcdrv_data.reclaim_buf) {
+        ret = -ENOMEM;
+        goto reclaim_free;
+    }
+
+    ret = register_shrinker(&pcd_shrinker);
+    if (ret)
+        goto reclaim_free;
+
     /* Create class and device files </sys/class/...> */
     pcdrv_data.class_pcd = class_create(THIS_MODULE, CLASS_NAME);
     if (IS_ERR(pcdrv_data.class_pcd)) {
         ret = PTR_ERR(pcdrv_data.class_pcd);
-        goto unregister_allocate_dd;
+        goto shrinker_del;
     }
 
+    /* Every probed device adds its own directory below */
+    pcdrv_data.debugfs_root = debugfs_create_dir(CLASS_NAME, NULL);
+    debugfs_create_file("probe", S_IRUGO, pcdrv_data.debugfs_root, NULL, &pcd_probe_fops);
+
+    if (sync_probe)
+        pcd_platform_driver.driver.probe_type = PROBE_FORCE_SYNCHRONOUS;
+
+    pcdrv_data.load_ns = ktime_get_ns();
     ret = platform_driver_register(&pcd_platform_driver);
     if (ret < 0)
         goto class_del;
@@ -277,10 +727,18 @@ static int __init char_platform_driver_init(void) {
     return 0;
 
 class_del:
+    debugfs_remove_recursive(pcdrv_data.debugfs_root);
     class_destroy(pcdrv_data.class_pcd);
-    unregister_chrdev_region(pcdrv_data.device_number_base, NO_OF_DEVICES);
+shrinker_del:
+    unregister_shrinker(&pcd_shrinker);
+reclaim_free:
+    kfree(pcdrv_data.reclaim_buf);
+    kfree(pcdrv_data.reclaim_wrkmem);
+    mempool_destroy(pcdrv_data.page_pool);
+cache_destroy:
+    kmem_cache_destroy(pcdrv_data.dev_cache);
 unregister_allocate_dd:
-    unregister_chrdev_region(pcdrv_data.device_number_base, NO_OF_DEVICES);
+    unregister_chrdev_region(pcdrv_data.device_number_base, PCD_MAX_DEVICES);
 error_out:
     return ret;
 
@@ -289,8 +747,16 @@ error_out:
 static void __exit char_platform_driver_exit(void) {
 
     platform_driver_unregister(&pcd_platform_driver);
+    debugfs_remove_recursive(pcdrv_data.debugfs_root);
     class_destroy(pcdrv_data.class_pcd);
-    unregister_chrdev_region(pcdrv_data.device_number_base, NO_OF_DEVICES);
+    unregister_shrinker(&pcd_shrinker);
+    kfree(pcdrv_data.reclaim_buf);
+    kfree(pcdrv_data.reclaim_wrkmem);
+    mempool_destroy(pcdrv_data.page_pool);
+    kmem_cache_destroy(pcdrv_data.dev_cache);
+    unregister_chrdev_region(pcdrv_data.device_number_base, PCD_MAX_DEVICES);
+    ida_destroy(&pcdrv_data.minor_ida);
+    xa_destroy(&pcdrv_data.devices);
 
     pr_info("Platform driver module unloaded\n");
 }
@@ -15,19 +15,42 @@
 #include <linux/device.h>
 #include <linux/kdev_t.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/mutex.h>
 #include <linux/mod_devicetable.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/llist.h>
+#include <linux/refcount.h>
+#include <linux/kref.h>
+#include <linux/idr.h>
+#include <linux/xarray.h>
+#include <linux/mempool.h>
+#include <linux/shrinker.h>
+#include <linux/lzo.h>
+#include <linux/jiffies.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/firmware.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
 #include "platform.h"
+#include "pcd_stats.h"
 
 #undef pr_fmt
 #define pr_fmt(fmt) "[%s]: " fmt, __func__
 
 #define CLASS_NAME      "pcd_class"
 #define DEV_NAME        "pcdevs"
-#define NO_OF_DEVICES   4
+/* Size of the minor space, minors are handed out by an IDA and reused after a remove */
+#define PCD_MAX_DEVICES 65536
 #define ATTR_GP_NAME    "pcd_attr_gp"
 
 /* Create dummy device configure */
@@ -47,29 +70,159 @@ struct device_configure {
 struct pcdev_private_data {
     struct pcdev_platform_data pdata;
     dev_t dev_num;
-    char *buffer;
-    struct cdev cdev;
+    int minor;                  /* Index in the minor space and in the device registry */
+    struct kref ref;            /* Held by the bound device and by every open file */
+    struct page **pages;        /* Backing pages, allocated on demand */
+    unsigned long nr_pages;
+    unsigned long max_pages;    /* Capacity of the page array, a power of two */
+    atomic_long_t nr_resident;  /* Allocated pages of the array */
+    struct xarray spill;        /* Page index -> struct pcd_spill of a reclaimed page */
+    unsigned long last_access;  /* Jiffies of the latest access to the buffer */
+    int node;                   /* NUMA node the buffer is allocated on */
+    struct completion loaded;   /* Done once the firmware preload filled the buffer */
+    u64 preload_start;
+    struct file *wb_file;       /* Write-back mode: the backing file, NULL until the first open and once removed */
+    struct work_struct wb_attach;   /* Opens and loads the backing file for the first open */
+    int wb_attach_ret;          /* Error of the latest failed load */
+    unsigned long *wb_dirty;    /* Write-back mode: pages written since their last write-back */
+    void *wb_buf;               /* Copy of the page being written back, the file write runs unlocked */
+    struct delayed_work wb_work;
+    struct mutex wb_lock;       /* Serializes write-backs, owns wb_buf and wb_file */
+    bool wb_stopped;            /* Under pcdev_lock: the device is going away, don't queue the work */
+    bool wb_mapped;             /* A writable mapping exists, mapped pages are always written back */
+    struct cdev *cdev;          /* Allocated apart, it may outlive the device data */
+    struct mutex pcdev_lock;    /* Serializes I/O against resizing the page array */
+    unsigned long fifo_out;     /* FIFO mode: ring position of the oldest byte */
+    unsigned long fifo_len;     /* FIFO mode: bytes held by the ring */
+    wait_queue_head_t fifo_rq;  /* Readers waiting for data */
+    wait_queue_head_t fifo_wq;  /* Writers waiting for room */
+    struct pcd_frame __rcu *frame_front;    /* Frame mode: the published frame */
+    struct llist_head frame_pool;   /* Spare back buffers, refilled after a grace period */
+    struct pcd_stats __percpu *stats;
+    struct dentry *debugfs;     /* <debugfs>/pcd_class/pcdev-N */
+};
+
+/* Compressed content of a page the shrinker reclaimed */
+struct pcd_spill {
+    size_t len;
+    u8 data[];
+};
+
+/* One frame of a frame mode device, the published one holds a reference of its own */
+struct pcd_frame {
+    struct rcu_head rcu;
+    struct llist_node node;
+    struct pcdev_private_data *dev_data;
+    refcount_t ref;
+    size_t size;
+    char data[];
 };
 
 /* Structure represents driver private data */
 struct pcdrv_private_data {
-    int total_device;
+    atomic_t total_device;
     dev_t device_number_base;
     struct class *class_pcd;
-    struct device *device_pcd;
+    struct dentry *debugfs_root;
+    struct ida minor_ida;       /* Free minors of the region */
+    struct xarray devices;      /* Minor -> struct pcdev_private_data of the bound devices */
+    struct kmem_cache *dev_cache;   /* struct pcdev_private_data of every device */
+    mempool_t *page_pool;       /* Buffer pages shared by every device, with a reserve for memory pressure */
+    unsigned long wb_interval;  /* Jiffies a dirty page waits before it is written back */
+    unsigned long reclaim_idle; /* Jiffies without access before the shrinker takes pages, 0 = never */
+    struct mutex reclaim_lock;  /* Owns the compression buffers below */
+    void *reclaim_wrkmem;
+    unsigned char *reclaim_buf;
+    struct mutex lock;          /* Probes run in parallel, protects the probe timing below */
+    u64 load_ns;                /* When the driver was registered */
+    u64 last_probe_ns;          /* When the latest probe finished */
+    u64 probe_total_ns;         /* Sum of the probe durations, the cost of a serial probe */
+    u64 probe_max_ns;
+    int probe_count;
 };
 
+extern struct pcdrv_private_data pcdrv_data;
+
+/* The prototype functions for the page backed device buffer */
+struct page *pcd_page_alloc(int node);
+void pcd_page_free(struct page *page);
+int pcd_buffer_init(struct pcdev_private_data *dev_data);
+int pcd_buffer_prealloc(struct pcdev_private_data *dev_data);
+int pcd_buffer_reserve(struct pcdev_private_data *dev_data);
+void pcd_preload_wait(void *data);
+int pcd_buffer_preload(struct pcdev_private_data *dev_data, struct device *dev);
+void pcd_firmware_loaded(const struct firmware *fw, void *context);
+void pcd_buffer_free(void *data);
+int pcd_page_spill(struct pcdev_private_data *dev_data, unsigned long index, struct page *page);
+int pcd_page_restore(struct page *page, struct pcd_spill *spill);
+unsigned long pcd_buffer_reclaim(struct pcdev_private_data *dev_data, unsigned long nr);
+struct pcdev_private_data *pcd_reclaim_next(unsigned long *index);
+unsigned long pcd_shrink_count(struct shrinker *shrinker, struct shrink_control *sc);
+unsigned long pcd_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc);
+struct page *pcd_buffer_page(struct pcdev_private_data *dev_data, unsigned long index, bool alloc);
+int pcd_buffer_resize(struct pcdev_private_data *dev_data, int size);
+ssize_t pcd_buffer_read(struct pcdev_private_data *dev_data, struct iov_iter *to, size_t count, loff_t pos);
+ssize_t pcd_buffer_write(struct pcdev_private_data *dev_data, struct iov_iter *from, size_t count, loff_t pos, bool nowait);
+
+/* The prototype functions for the write-back mode */
+int pcd_wb_init(struct pcdev_private_data *dev_data, struct device *dev);
+int pcd_wb_load(struct pcdev_private_data *dev_data);
+void pcd_wb_attach_work(struct work_struct *work);
+int pcd_wb_attach(struct pcdev_private_data *dev_data);
+void pcd_wb_release(void *data);
+void pcd_wb_mark(struct pcdev_private_data *dev_data, unsigned long index);
+int pcd_wb_flush(struct pcdev_private_data *dev_data, bool sync);
+void pcd_wb_work(struct work_struct *work);
+int pcd_fsync(struct file *filp, loff_t start, loff_t end, int datasync);
+
+/* The prototype functions for the FIFO mode */
+void pcd_fifo_init(struct pcdev_private_data *dev_data);
+void pcd_fifo_reset(struct pcdev_private_data *dev_data);
+unsigned long pcd_fifo_len(struct pcdev_private_data *dev_data);
+ssize_t pcd_fifo_copy(struct pcdev_private_data *dev_data, struct iov_iter *iter, size_t count, unsigned long pos, bool write, bool nowait);
+ssize_t pcd_fifo_copy_to_pipe(struct pcdev_private_data *dev_data, struct iov_iter *to, size_t count, unsigned long pos);
+ssize_t pcd_fifo_read(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_fifo_write(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *from);
+
+/* The prototype functions for the frame mode */
+void pcd_frame_rcu(struct rcu_head *head);
+void pcd_frame_put(struct pcd_frame *frame);
+struct pcd_frame *pcd_frame_alloc(struct pcdev_private_data *dev_data, size_t size, gfp_t gfp);
+int pcd_frame_init(struct pcdev_private_data *dev_data);
+void pcd_frame_free(void *data);
+int pcd_frame_resize(struct pcdev_private_data *dev_data, int size);
+struct pcd_frame *pcd_frame_get(struct pcdev_private_data *dev_data);
+ssize_t pcd_frame_read(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_frame_write(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *from);
+
 /* The prototype functions for the file operations of character driver */
 int check_permission(int permission, int access_mode);
+struct pcdev_private_data *pcd_open_dev(struct inode *inode, struct file *filp);
 int pcd_open(struct inode *inode, struct file *filp);
+int pcd_open_rdwr(struct inode *inode, struct file *filp);
+int pcd_open_rdonly(struct inode *inode, struct file *filp);
+int pcd_open_wronly(struct inode *inode, struct file *filp);
 int pcd_release(struct inode *inode, struct file *filp);
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t *f_pos);
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos);
+ssize_t pcd_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_write_iter(struct kiocb *iocb, struct iov_iter *from);
+ssize_t pcd_buffer_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_buffer_write_iter(struct kiocb *iocb, struct iov_iter *from);
 loff_t pcd_lseek(struct file *filp, loff_t offset, int whence);
+int pcd_mmap(struct file *filp, struct vm_area_struct *vma);
+__poll_t pcd_poll(struct file *filp, poll_table *wait);
 
 /* The prototype functions for the platform driver */
 int pcd_platform_driver_probe(struct platform_device *pdev);
+int pcd_probe_device(struct platform_device *pdev);
+const struct file_operations *pcd_select_fops(struct pcdev_platform_data *pdata);
 int pcd_platform_driver_remove(struct platform_device *pdev);
+int pcd_probe_show(struct seq_file *m, void *unused);
+
+/* The prototype functions for the device registry */
+struct pcdev_private_data *pcd_dev_get(int minor);
+void pcd_dev_release(struct kref *ref);
+void pcd_dev_put(void *data);
+void pcd_minor_free(void *data);
 
 /* The prototype functions for device attributes */
 ssize_t max_size_show(struct device *dev, struct device_attribute *attr, char *buf);
@@ -78,6 +231,7 @@ ssize_t serial_number_show(struct device *dev, struct device_attribute *attr, ch
 
 /* Other sub-functions */
 struct pcdev_platform_data* pcdev_check_pf_dt(struct device *dev);
+int pcdev_check_reserved_mem(struct device *dev, struct pcdev_platform_data *pdata);
 int pcd_sysfs_create(struct device *dev);
 
 #endif // PCD_DRIVER_DT_SYSFS_H
\ No newline at end of file
@@ -0,0 +1,216 @@
+/*
+ * @brief: FIFO mode of a device, the page backed buffer is used as a ring with
+ *         blocking/non-blocking read & write, poll and threshold based wakeups
+ * @author: NghiaPham
+ * @ver: v0.1
+ * @date: 2020/12/20
+ *
+*/
+
+#include "pcd_driver_dt_sysfs.h"
+
+/* Set up the FIFO state of a device, the thresholds are kept inside the ring size */
+void pcd_fifo_init(struct pcdev_private_data *dev_data) {
+
+    init_waitqueue_head(&dev_data->fifo_rq);
+    init_waitqueue_head(&dev_data->fifo_wq);
+    pcd_fifo_reset(dev_data);
+}
+
+/* Empty the ring and clamp the thresholds to the current size, caller holds pcdev_lock or owns the device */
+void pcd_fifo_reset(struct pcdev_private_data *dev_data) {
+
+    dev_data->fifo_out = 0;
+    WRITE_ONCE(dev_data->fifo_len, 0);
+    dev_data->pdata.fifo_rd_threshold = clamp_t(u32, dev_data->pdata.fifo_rd_threshold, 1, dev_data->pdata.size);
+    dev_data->pdata.fifo_wr_threshold = clamp_t(u32, dev_data->pdata.fifo_wr_threshold, 1, dev_data->pdata.size);
+}
+
+/* Lockless snapshot of the fill level, only used for wait conditions and poll */
+unsigned long pcd_fifo_len(struct pcdev_private_data *dev_data) {
+
+    return READ_ONCE(dev_data->fifo_len);
+}
+
+/* Copy count bytes between the iterator and the ring from ring position pos, wrapping at the end */
+ssize_t pcd_fifo_copy(struct pcdev_private_data *dev_data, struct iov_iter *iter, size_t count, unsigned long pos, bool write, bool nowait) {
+
+    size_t done = 0, chunk;
+    ssize_t ret;
+
+    while (done < count) {
+        pos %= dev_data->pdata.size;
+        chunk = min_t(size_t, count - done, dev_data->pdata.size - pos);
+
+        if (write)
+            ret = pcd_buffer_write(dev_data, iter, chunk, pos, nowait);
+        else if (iov_iter_is_pipe(iter))
+            ret = pcd_fifo_copy_to_pipe(dev_data, iter, chunk, pos);
+        else
+            ret = pcd_buffer_read(dev_data, iter, chunk, pos);
+        if (ret < 0)
+            return done ? done : ret;
+
+        done += ret;
+        pos += ret;
+        if ((size_t)ret < chunk)
+            break;
+    }
+
+    return done;
+}
+
+/* The ring reuses its pages, so a pipe gets copies of them instead of references */
+ssize_t pcd_fifo_copy_to_pipe(struct pcdev_private_data *dev_data, struct iov_iter *to, size_t count, unsigned long pos) {
+
+    size_t done = 0, chunk, copied;
+    unsigned long offset;
+    struct page *page;
+
+    while (done < count) {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - done);
+
+        page = pcd_buffer_page(dev_data, (pos + done) >> PAGE_SHIFT, false);
+        if (IS_ERR(page))
+            return done ? done : PTR_ERR(page);
+        if (page) {
+            copied = copy_to_iter(kmap(page) + offset, chunk, to);
+            kunmap(page);
+        } else {
+            copied = iov_iter_zero(chunk, to);
+        }
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    return (done || !count) ? done : -EFAULT;
+}
+
+/* Blocking readers wait for the read threshold, non-blocking readers take whatever is there */
+ssize_t pcd_fifo_read(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *to) {
+
+    bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    size_t count = iov_iter_count(to);
+    unsigned long len, room;
+    ssize_t ret;
+
+    if (!count)
+        return 0;
+
+    for (;;) {
+        if (iocb->ki_flags & IOCB_NOWAIT) {
+            if (!mutex_trylock(&dev_data->pcdev_lock))
+                return -EAGAIN;
+        } else if (pcd_stats_mutex_lock(dev_data->stats, &dev_data->pcdev_lock)) {
+            return -EINTR;
+        }
+
+        len = dev_data->fifo_len;
+        if ((len >= dev_data->pdata.fifo_rd_threshold) || (len && nonblock))
+            break;
+        mutex_unlock(&dev_data->pcdev_lock);
+
+        if (nonblock)
+            return -EAGAIN;
+
+        if (wait_event_interruptible(dev_data->fifo_rq, pcd_fifo_len(dev_data) >= dev_data->pdata.fifo_rd_threshold))
+            return -ERESTARTSYS;
+    }
+
+    ret = pcd_fifo_copy(dev_data, to, min_t(size_t, count, len), dev_data->fifo_out, false, false);
+    if (ret > 0) {
+        dev_data->fifo_out = (dev_data->fifo_out + ret) % dev_data->pdata.size;
+        WRITE_ONCE(dev_data->fifo_len, len - ret);
+    }
+    mutex_unlock(&dev_data->pcdev_lock);
+
+    /* Only wake up the writers when the free room crosses their threshold */
+    room = dev_data->pdata.size - len;
+    if ((ret > 0) && (room < dev_data->pdata.fifo_wr_threshold) && (room + ret >= dev_data->pdata.fifo_wr_threshold))
+        wake_up_interruptible_poll(&dev_data->fifo_wq, EPOLLOUT | EPOLLWRNORM);
+
+    return ret;
+}
+
+/* Blocking writers write everything, sleeping until the write threshold is free whenever the ring is full */
+ssize_t pcd_fifo_write(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *from) {
+
+    bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    size_t count = iov_iter_count(from), done = 0, chunk;
+    unsigned long len, room;
+    ssize_t ret = 0;
+
+    while (done < count) {
+        if (iocb->ki_flags & IOCB_NOWAIT) {
+            if (!mutex_trylock(&dev_data->pcdev_lock)) {
+                ret = -EAGAIN;
+                break;
+            }
+        } else if (pcd_stats_mutex_lock(dev_data->stats, &dev_data->pcdev_lock)) {
+            ret = -EINTR;
+            break;
+        }
+
+        len = dev_data->fifo_len;
+        room = dev_data->pdata.size - len;
+        if (!room) {
+            mutex_unlock(&dev_data->pcdev_lock);
+
+            if (nonblock) {
+                ret = -EAGAIN;
+                break;
+            }
+
+            if (wait_event_interruptible(dev_data->fifo_wq,
+                    dev_data->pdata.size - pcd_fifo_len(dev_data) >= dev_data->pdata.fifo_wr_threshold)) {
+                ret = -ERESTARTSYS;
+                break;
+            }
+            continue;
+        }
+
+        chunk = min_t(size_t, count - done, room);
+        ret = pcd_fifo_copy(dev_data, from, chunk, dev_data->fifo_out + len, true, iocb->ki_flags & IOCB_NOWAIT);
+        if (ret > 0)
+            WRITE_ONCE(dev_data->fifo_len, len + ret);
+        mutex_unlock(&dev_data->pcdev_lock);
+
+        if (ret <= 0)
+            break;
+
+        /* Only wake up the readers when the fill level crosses their threshold */
+        if ((len < dev_data->pdata.fifo_rd_threshold) && (len + ret >= dev_data->pdata.fifo_rd_threshold))
+            wake_up_interruptible_poll(&dev_data->fifo_rq, EPOLLIN | EPOLLRDNORM);
+
+        done += ret;
+        if ((size_t)ret < chunk)
+            break;
+    }
+
+    return done ? done : ret;
+}
+
+/* A FIFO reports its fill thresholds, a random access device is always ready */
+__poll_t pcd_poll(struct file *filp, poll_table *wait) {
+
+    unsigned long len;
+    __poll_t mask = 0;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+
+    if (!pcdev_data->pdata.fifo)
+        return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &pcdev_data->fifo_rq, wait);
+    poll_wait(filp, &pcdev_data->fifo_wq, wait);
+
+    len = pcd_fifo_len(pcdev_data);
+    if (len >= pcdev_data->pdata.fifo_rd_threshold)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (pcdev_data->pdata.size - len >= pcdev_data->pdata.fifo_wr_threshold)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+
+    return mask;
+}
@@ -0,0 +1,135 @@
+/*
+ * @brief: Microbenchmark of the per variant file operations. Times open/close,
+ *         pread and pwrite of small requests on every given pcdev, run it once with
+ *         the module loaded normally and once with generic_fops=1 to see the gain.
+ *         Build: gcc -O2 -Wall -o pcd_fops_bench pcd_fops_bench.c
+ *         Usage: ./pcd_fops_bench [-n iterations] [-b bytes] /dev/pcdev-0 /dev/pcdev-2 ...
+ * @author: NghiaPham
+ * @date: 2020/12/20
+ * @version: v0.1
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_ITERATIONS  200000
+#define DEFAULT_BYTES       16
+#define MAX_BYTES           4096
+
+static char buffer[MAX_BYTES];
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* A device accepts the widest of O_RDWR, O_RDONLY and O_WRONLY its permission allows */
+static int open_device(const char *name, int *flags) {
+
+    static const int modes[] = { O_RDWR, O_RDONLY, O_WRONLY };
+    int i, fd;
+
+    for (i = 0; i < 3; i++) {
+        fd = open(name, modes[i]);
+        if (fd >= 0) {
+            *flags = modes[i];
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+static void bench_open(const char *name, int flags, long iterations) {
+
+    long i;
+    int fd;
+    uint64_t t0 = now_ns();
+
+    for (i = 0; i < iterations; i++) {
+        fd = open(name, flags);
+        if (fd < 0) {
+            perror(name);
+            return;
+        }
+        close(fd);
+    }
+
+    printf("  open/close %8llu ns/op\n", (unsigned long long)((now_ns() - t0) / iterations));
+}
+
+static void bench_io(int fd, int write_io, size_t bytes, long iterations) {
+
+    long i;
+    ssize_t ret;
+    uint64_t t0 = now_ns();
+
+    for (i = 0; i < iterations; i++) {
+        ret = write_io ? pwrite(fd, buffer, bytes, 0) : pread(fd, buffer, bytes, 0);
+        if (ret < 0) {
+            perror(write_io ? "pwrite" : "pread");
+            return;
+        }
+    }
+
+    printf("  %-10s %8llu ns/op\n", write_io ? "pwrite" : "pread",
+           (unsigned long long)((now_ns() - t0) / iterations));
+}
+
+int main(int argc, char *argv[]) {
+
+    int opt, i, fd, flags;
+    long iterations = DEFAULT_ITERATIONS;
+    size_t bytes = DEFAULT_BYTES;
+
+    while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = strtol(optarg, NULL, 0);
+                break;
+            case 'b':
+                bytes = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n iterations] [-b bytes] device...\n", argv[0]);
+                return EINVAL;
+        }
+    }
+
+    if ((optind >= argc) || (iterations <= 0) || !bytes || (bytes > MAX_BYTES)) {
+        fprintf(stderr, "Usage: %s [-n iterations] [-b bytes (1-%d)] device...\n", argv[0], MAX_BYTES);
+        return EINVAL;
+    }
+
+    memset(buffer, 'A', sizeof(buffer));
+    printf("%ld iterations of %zu bytes\n", iterations, bytes);
+
+    for (i = optind; i < argc; i++) {
+        fd = open_device(argv[i], &flags);
+        if (fd < 0) {
+            perror(argv[i]);
+            continue;
+        }
+
+        printf("%s (%s)\n", argv[i], flags == O_RDWR ? "RDWR" : (flags == O_RDONLY ? "RDONLY" : "WRONLY"));
+        bench_open(argv[i], flags, iterations);
+        if (flags != O_WRONLY)
+            bench_io(fd, 0, bytes, iterations);
+        if (flags != O_RDONLY)
+            bench_io(fd, 1, bytes, iterations);
+
+        close(fd);
+    }
+
+    return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * @brief: Frame mode of a device, writers fill a back buffer and publish it with an
+ *         RCU pointer swap, readers always copy a complete frame without any lock
+ * @author: NghiaPham
+ * @ver: v0.1
+ * @date: 2020/12/20
+ *
+*/
+
+#include "pcd_driver_dt_sysfs.h"
+
+/* Frames retired by the last reader go back to the pool once no RCU reader can still see them */
+void pcd_frame_rcu(struct rcu_head *head) {
+
+    struct pcd_frame *frame = container_of(head, struct pcd_frame, rcu);
+
+    llist_add(&frame->node, &frame->dev_data->frame_pool);
+}
+
+void pcd_frame_put(struct pcd_frame *frame) {
+
+    if (refcount_dec_and_test(&frame->ref))
+        call_rcu(&frame->rcu, pcd_frame_rcu);
+}
+
+/* Take a back buffer from the pool or allocate one, caller holds pcdev_lock (single pool consumer) */
+struct pcd_frame *pcd_frame_alloc(struct pcdev_private_data *dev_data, size_t size, gfp_t gfp) {
+
+    struct llist_node *node;
+    struct pcd_frame *frame;
+
+    while ((node = llist_del_first(&dev_data->frame_pool))) {
+        frame = llist_entry(node, struct pcd_frame, node);
+        if (frame->size == size)
+            goto found;
+        /* Left over from before a resize */
+        kfree(frame);
+    }
+
+    frame = kmalloc(struct_size(frame, data, size), gfp);
+    if (!frame)
+        return NULL;
+    frame->dev_data = dev_data;
+    frame->size = size;
+
+found:
+    refcount_set(&frame->ref, 1);
+    return frame;
+}
+
+/* Publish a zeroed first frame, the published frame holds one reference of its own */
+int pcd_frame_init(struct pcdev_private_data *dev_data) {
+
+    struct pcd_frame *frame;
+
+    init_llist_head(&dev_data->frame_pool);
+    RCU_INIT_POINTER(dev_data->frame_front, NULL);
+    if (!dev_data->pdata.frame)
+        return 0;
+
+    frame = pcd_frame_alloc(dev_data, dev_data->pdata.size, GFP_KERNEL);
+    if (!frame)
+        return -ENOMEM;
+    memset(frame->data, 0, frame->size);
+    rcu_assign_pointer(dev_data->frame_front, frame);
+
+    return 0;
+}
+
+/* Free the published frame and the pool, from pcd_dev_release() on the last put, no reader is left */
+void pcd_frame_free(void *data) {
+
+    struct pcdev_private_data *dev_data = data;
+    struct llist_node *node;
+    struct pcd_frame *frame, *next;
+
+    if (!dev_data->pdata.frame)
+        return;
+
+    /* Frames released by the last readers are still on their way to the pool */
+    rcu_barrier();
+
+    kfree(rcu_dereference_protected(dev_data->frame_front, 1));
+    node = llist_del_all(&dev_data->frame_pool);
+    llist_for_each_entry_safe(frame, next, node, node)
+        kfree(frame);
+}
+
+/* Publish a frame of the new size keeping the content that still fits, caller holds pcdev_lock */
+int pcd_frame_resize(struct pcdev_private_data *dev_data, int size) {
+
+    struct pcd_frame *front, *frame;
+
+    front = rcu_dereference_protected(dev_data->frame_front, lockdep_is_held(&dev_data->pcdev_lock));
+
+    frame = pcd_frame_alloc(dev_data, size, GFP_KERNEL);
+    if (!frame)
+        return -ENOMEM;
+
+    memcpy(frame->data, front->data, min_t(size_t, size, front->size));
+    if (size > front->size)
+        memset(frame->data + front->size, 0, size - front->size);
+
+    rcu_assign_pointer(dev_data->frame_front, frame);
+    pcd_frame_put(front);
+    dev_data->pdata.size = size;
+
+    return 0;
+}
+
+/* Reference the published frame, retrying if a writer retired it meanwhile */
+struct pcd_frame *pcd_frame_get(struct pcdev_private_data *dev_data) {
+
+    struct pcd_frame *frame;
+
+    rcu_read_lock();
+    do {
+        frame = rcu_dereference(dev_data->frame_front);
+    } while (!refcount_inc_not_zero(&frame->ref));
+    rcu_read_unlock();
+
+    return frame;
+}
+
+/* Readers never take the writer's lock, they copy out of the frame they referenced */
+ssize_t pcd_frame_read(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *to) {
+
+    size_t count = iov_iter_count(to), copied;
+    loff_t pos = iocb->ki_pos;
+    struct pcd_frame *frame;
+
+    frame = pcd_frame_get(dev_data);
+
+    if (pos >= frame->size)
+        count = 0;
+    else if ((pos + count) > frame->size)
+        count = frame->size - pos;
+
+    copied = copy_to_iter(frame->data + pos, count, to);
+    pcd_frame_put(frame);
+
+    if (count && !copied)
+        return -EFAULT;
+
+    iocb->ki_pos += copied;
+    return copied;
+}
+
+/* Fill a back buffer and swap it in, readers see either the old or the new frame */
+ssize_t pcd_frame_write(struct pcdev_private_data *dev_data, struct kiocb *iocb, struct iov_iter *from) {
+
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    size_t count = iov_iter_count(from), copied;
+    loff_t pos = iocb->ki_pos;
+    struct pcd_frame *front, *back;
+    ssize_t ret;
+
+    if (nowait) {
+        if (!mutex_trylock(&dev_data->pcdev_lock))
+            return -EAGAIN;
+    } else if (pcd_stats_mutex_lock(dev_data->stats, &dev_data->pcdev_lock)) {
+        return -EINTR;
+    }
+
+    front = rcu_dereference_protected(dev_data->frame_front, lockdep_is_held(&dev_data->pcdev_lock));
+
+    /* Ajust the count argument, pwrite may start beyond the end of the frame */
+    if (pos >= front->size)
+        count = 0;
+    else if ((pos + count) > front->size)
+        count = front->size - pos;
+
+    if (!count) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    back = pcd_frame_alloc(dev_data, front->size, nowait ? GFP_NOWAIT : GFP_KERNEL);
+    if (!back) {
+        ret = nowait ? -EAGAIN : -ENOMEM;
+        goto out;
+    }
+
+    copied = copy_from_iter(back->data + pos, count, from);
+    if (!copied) {
+        pcd_frame_put(back);
+        ret = -EFAULT;
+        goto out;
+    }
+
+    /* Whatever the write didn't cover keeps the content of the previous frame */
+    if (pos)
+        memcpy(back->data, front->data, pos);
+    if (pos + copied < front->size)
+        memcpy(back->data + pos + copied, front->data + pos + copied, front->size - pos - copied);
+
+    rcu_assign_pointer(dev_data->frame_front, back);
+    pcd_frame_put(front);
+
+    iocb->ki_pos += copied;
+    ret = copied;
+
+out:
+    mutex_unlock(&dev_data->pcdev_lock);
+    return ret;
+}
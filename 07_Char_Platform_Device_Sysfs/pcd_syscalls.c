@@ -8,6 +8,9 @@
 
 #include "pcd_driver_dt_sysfs.h"
 
+#define CREATE_TRACE_POINTS
+#include "pcd_trace.h"
+
 int check_permission(int permission, int access_mode){
 
     if (permission == RDWR)
@@ -24,79 +27,245 @@ int check_permission(int permission, int access_mode){
     return -EPERM;
 }
 
-int pcd_open(struct inode *inode, struct file *filp) {
+/* Open part shared by every variant, the file holds a reference on the device until release */
+struct pcdev_private_data *pcd_open_dev(struct inode *inode, struct file *filp) {
 
     int minor_no, ret;
     struct pcdev_private_data *pcdev_data;
 
     /* Find out on on which device file open was attempted by user space */
-    minor_no = MINOR(inode->i_rdev);
+    minor_no = MINOR(inode->i_rdev) - MINOR(pcdrv_data.device_number_base);
 
     /* Get device's private data structure */
-    pcdev_data = container_of(inode->i_cdev, struct pcdev_private_data, cdev);
+    pcdev_data = pcd_dev_get(minor_no);
+    if (!pcdev_data)
+        return ERR_PTR(-ENODEV);
+
+    /* The firmware preload is still filling the buffer: wait for it, or don't for O_NONBLOCK */
+    if (!completion_done(&pcdev_data->loaded)) {
+        if (filp->f_flags & O_NONBLOCK)
+            ret = -EAGAIN;
+        else
+            ret = wait_for_completion_interruptible(&pcdev_data->loaded);
+        if (ret) {
+            pcd_dev_put(pcdev_data);
+            return ERR_PTR(ret);
+        }
+    }
+
+    /* Write-back mode: the file system of the backing file is mounted by the time user space opens */
+    if (pcdev_data->pdata.backing_file) {
+        ret = pcd_wb_attach(pcdev_data);
+        if (ret) {
+            pcd_dev_put(pcdev_data);
+            return ERR_PTR(ret);
+        }
+    }
 
     /* Supply device private data to other method of the driver */
     filp->private_data = pcdev_data;
 
+    /* Reads and writes honour IOCB_NOWAIT, so preadv2/pwritev2 may use RWF_NOWAIT */
+    filp->f_mode |= FMODE_NOWAIT;
+
+    return pcdev_data;
+}
+
+/* Read write buffer device: its fops only exist for this permission, nothing left to check */
+int pcd_open_rdwr(struct inode *inode, struct file *filp) {
+
+    return PTR_ERR_OR_ZERO(pcd_open_dev(inode, filp));
+}
+
+int pcd_open_rdonly(struct inode *inode, struct file *filp) {
+
+    if (filp->f_mode & FMODE_WRITE)
+        return -EPERM;
+
+    return pcd_open_rdwr(inode, filp);
+}
+
+int pcd_open_wronly(struct inode *inode, struct file *filp) {
+
+    if (filp->f_mode & FMODE_READ)
+        return -EPERM;
+
+    return pcd_open_rdwr(inode, filp);
+}
+
+/* Generic open of FIFO and frame devices, any permission */
+int pcd_open(struct inode *inode, struct file *filp) {
+
+    int ret;
+    struct pcdev_private_data *pcdev_data;
+
+    pcdev_data = pcd_open_dev(inode, filp);
+    if (IS_ERR(pcdev_data))
+        return PTR_ERR(pcdev_data);
+
+    /* A FIFO has no file position, lseek and pread/pwrite fail with -ESPIPE */
+    if (pcdev_data->pdata.fifo)
+        stream_open(inode, filp);
+
     /* Check permission */
     ret = check_permission(pcdev_data->pdata.permission, filp->f_mode);
-    if (!ret)
+    if (!ret) {
         pr_info("Open was successful\n");
-    else
+    } else {
         pr_info("Open was unsuccessful\n");
+        pcd_dev_put(pcdev_data);
+    }
 
     return ret;
 }
 
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t *f_pos) {
+/* Generic read, dispatches on the device mode */
+ssize_t pcd_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+
+    ssize_t ret;
+    size_t requested = iov_iter_count(to);
+    loff_t pos = iocb->ki_pos;
+    /* Only read the clock when somebody listens to the tracepoint */
+    u64 start = trace_pcd_read_enabled() ? ktime_get_ns() : 0;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
+
+    /* A FIFO device has its own blocking rules */
+    if (pcdev_data->pdata.fifo)
+        ret = pcd_fifo_read(pcdev_data, iocb, to);
+    else if (pcdev_data->pdata.frame)
+        ret = pcd_frame_read(pcdev_data, iocb, to);
+    else
+        return pcd_buffer_read_iter(iocb, to);
+
+    pcd_stats_io(pcdev_data->stats, false, requested, ret);
+    trace_pcd_read(file_inode(iocb->ki_filp)->i_rdev, pos, requested, ret,
+                   start ? ktime_get_ns() - start : 0);
+    return ret;
+}
+
+/* Read of a buffer device, the read_iter of the specialized fops */
+ssize_t pcd_buffer_read_iter(struct kiocb *iocb, struct iov_iter *to) {
 
     int max_size;
-    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+    ssize_t ret;
+    size_t count = iov_iter_count(to);
+    size_t requested = count;
+    loff_t pos = iocb->ki_pos;
+    /* Only read the clock when somebody listens to the tracepoint */
+    u64 start = trace_pcd_read_enabled() ? ktime_get_ns() : 0;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
+
+    /* RWF_NOWAIT, or O_NONBLOCK on a trylock device: give up instead of sleeping on a busy device */
+    if ((iocb->ki_flags & IOCB_NOWAIT) ||
+        (pcdev_data->pdata.lock_trylock && (iocb->ki_filp->f_flags & O_NONBLOCK))) {
+        if (!mutex_trylock(&pcdev_data->pcdev_lock)) {
+            ret = -EAGAIN;
+            goto out_trace;
+        }
+    } else if (pcd_stats_mutex_lock(pcdev_data->stats, &pcdev_data->pcdev_lock)) {
+        ret = -EINTR;
+        goto out_trace;
+    }
+
     max_size = pcdev_data->pdata.size;
 
-    pr_info("Read requested for %zu bytes \n",count);
-    pr_info("Current file position = %lld\n",*f_pos);
+    /* Ajust the count argument, pread may start beyond the end of the device */
+    if (pos >= max_size)
+        count = 0;
+    else if ((pos + count) > max_size)
+        count = max_size - pos;
 
-    /* Ajust the count argument */
-    if ((*f_pos + count) > max_size)
-        count = max_size - *f_pos;
+    ret = pcd_buffer_read(pcdev_data, to, count, pos);
+    if (ret < 0)
+        goto out;
 
-    if (copy_to_user(buff, pcdev_data->buffer, count))
-        return -EFAULT;
-    
     /* Update current file position */
-    *f_pos += count;
-    pr_info("Number of bytes successfully read = %zu\n", count);
-    pr_info("Updated file position = %lld\n",*f_pos);
+    iocb->ki_pos += ret;
 
-    return count;
+out:
+    mutex_unlock(&pcdev_data->pcdev_lock);
+out_trace:
+    pcd_stats_io(pcdev_data->stats, false, requested, ret);
+    trace_pcd_read(file_inode(iocb->ki_filp)->i_rdev, pos, requested, ret,
+                   start ? ktime_get_ns() - start : 0);
+    return ret;
 }
 
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos) {
+/* Generic write, dispatches on the device mode */
+ssize_t pcd_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+
+    ssize_t ret;
+    size_t requested = iov_iter_count(from);
+    loff_t pos = iocb->ki_pos;
+    /* Only read the clock when somebody listens to the tracepoint */
+    u64 start = trace_pcd_write_enabled() ? ktime_get_ns() : 0;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
+
+    /* A FIFO device has its own blocking rules */
+    if (pcdev_data->pdata.fifo)
+        ret = pcd_fifo_write(pcdev_data, iocb, from);
+    else if (pcdev_data->pdata.frame)
+        ret = pcd_frame_write(pcdev_data, iocb, from);
+    else
+        return pcd_buffer_write_iter(iocb, from);
+
+    pcd_stats_io(pcdev_data->stats, true, requested, ret);
+    trace_pcd_write(file_inode(iocb->ki_filp)->i_rdev, pos, requested, ret,
+                    start ? ktime_get_ns() - start : 0);
+    return ret;
+}
+
+/* Write of a buffer device, the write_iter of the specialized fops */
+ssize_t pcd_buffer_write_iter(struct kiocb *iocb, struct iov_iter *from) {
 
     int max_size;
-    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
-    max_size = pcdev_data->pdata.size;
+    ssize_t ret;
+    size_t count = iov_iter_count(from);
+    size_t requested = count;
+    loff_t pos = iocb->ki_pos;
+    /* Only read the clock when somebody listens to the tracepoint */
+    u64 start = trace_pcd_write_enabled() ? ktime_get_ns() : 0;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
 
-    pr_info("Write requested %zu bytes \n",count);
-    pr_info("Current file position = %lld\n",*f_pos);
+    /* RWF_NOWAIT, or O_NONBLOCK on a trylock device: give up instead of sleeping on a busy device */
+    if ((iocb->ki_flags & IOCB_NOWAIT) ||
+        (pcdev_data->pdata.lock_trylock && (iocb->ki_filp->f_flags & O_NONBLOCK))) {
+        if (!mutex_trylock(&pcdev_data->pcdev_lock)) {
+            ret = -EAGAIN;
+            goto out_trace;
+        }
+    } else if (pcd_stats_mutex_lock(pcdev_data->stats, &pcdev_data->pcdev_lock)) {
+        ret = -EINTR;
+        goto out_trace;
+    }
 
-    /* Ajust the count argument */
-    if ((*f_pos + count) > max_size)
-        count = max_size - *f_pos;
+    max_size = pcdev_data->pdata.size;
 
-    if (!count)
-        return -ENOMEM;
+    /* Ajust the count argument, pwrite may start beyond the end of the device */
+    if (pos >= max_size)
+        count = 0;
+    else if ((pos + count) > max_size)
+        count = max_size - pos;
 
-    if (copy_from_user(pcdev_data->buffer, buff, count))
-        return -EFAULT;
+    if (!count) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = pcd_buffer_write(pcdev_data, from, count, pos, iocb->ki_flags & IOCB_NOWAIT);
+    if (ret < 0)
+        goto out;
 
     /* Update current file position */
-    *f_pos += count;
-    pr_info("Number of bytes successfully written = %zu\n", count);
-    pr_info("Updated file position = %lld\n",*f_pos);
+    iocb->ki_pos += ret;
 
-    return count;
+out:
+    mutex_unlock(&pcdev_data->pcdev_lock);
+out_trace:
+    pcd_stats_io(pcdev_data->stats, true, requested, ret);
+    trace_pcd_write(file_inode(iocb->ki_filp)->i_rdev, pos, requested, ret,
+                    start ? ktime_get_ns() - start : 0);
+    return ret;
 }
 
 loff_t pcd_lseek(struct file *filp, loff_t offset, int whence) {
@@ -128,11 +297,76 @@ loff_t pcd_lseek(struct file *filp, loff_t offset, int whence) {
             return -EINVAL;
     }
 
-    pr_info("New value of the file position = %lld\n",filp->f_pos);
+    trace_pcd_lseek(file_inode(filp)->i_rdev, offset, whence, filp->f_pos);
     return filp->f_pos;
 }
 
+int pcd_mmap(struct file *filp, struct vm_area_struct *vma) {
+
+    int ret = 0;
+    unsigned long i;
+    struct page *page;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+
+    /* The content of a FIFO or a frame device moves, there is nothing stable to map */
+    if (pcdev_data->pdata.fifo || pcdev_data->pdata.frame)
+        return -ENODEV;
+
+    /*
+     * Only shared mappings make sense, private ones would hide the device content. Test VM_MAYSHARE:
+     * mmap() clears VM_SHARED of a MAP_SHARED mapping of a file opened read only
+     */
+    if (!(vma->vm_flags & VM_MAYSHARE))
+        return -EINVAL;
+
+    /* A write only page can't be expressed by the MMU, so write only devices are never mapped */
+    if (pcdev_data->pdata.permission == WRONLY)
+        return -EPERM;
+
+    /* Read only device: refuse writable mappings and forbid a later mprotect(PROT_WRITE) */
+    if (pcdev_data->pdata.permission == RDONLY) {
+        if (vma->vm_flags & VM_WRITE)
+            return -EPERM;
+        vma->vm_flags &= ~VM_MAYWRITE;
+    }
+
+    mutex_lock(&pcdev_data->pcdev_lock);
+
+    /* The mapping must stay inside the (page aligned) device buffer */
+    if ((vma->vm_pgoff >= pcdev_data->nr_pages) || (vma_pages(vma) > pcdev_data->nr_pages - vma->vm_pgoff)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* Stores through the mapping bypass write(), the write-back copies mapped pages on every pass */
+    if (pcdev_data->wb_dirty && (vma->vm_flags & VM_MAYWRITE) && !pcdev_data->wb_mapped) {
+        pcdev_data->wb_mapped = true;
+        if (!pcdev_data->wb_stopped)
+            schedule_delayed_work(&pcdev_data->wb_work, pcdrv_data.wb_interval);
+    }
+
+    /* Populate the mapped range up front, so no fault handler is needed */
+    for (i = vma->vm_pgoff; i < vma->vm_pgoff + vma_pages(vma); i++) {
+        page = pcd_buffer_page(pcdev_data, i, true);
+        if (IS_ERR(page)) {
+            ret = PTR_ERR(page);
+            goto out;
+        }
+    }
+
+    /*
+     * No vm_operations keep a pointer to the device: the mapping only holds references
+     * on the buffer pages, so it stays valid after the device is removed or resized.
+     */
+    ret = vm_map_pages(vma, pcdev_data->pages, pcdev_data->nr_pages);
+
+out:
+    mutex_unlock(&pcdev_data->pcdev_lock);
+    return ret;
+}
+
 int pcd_release(struct inode *inode, struct file *filp) {
+    pcd_dev_put(filp->private_data);
     pr_info("Released successful\n");
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,251 @@
+/*
+ * @brief: Write-back mode of a device, the buffer caches a backing file. Writes only mark
+ *         their pages dirty, a delayed work copies the dirty pages to the file after the
+ *         write-back interval and fsync on the device flushes them at once. The file is
+ *         opened on the first open of the device, an asynchronous probe may run before
+ *         the file system holding it is mounted.
+ * @author: NghiaPham
+ * @ver: v0.1
+ * @date: 2020/12/20
+ *
+*/
+
+#include "pcd_driver_dt_sysfs.h"
+
+/* Set up the write-back of a device at probe, the backing file itself is opened later */
+int pcd_wb_init(struct pcdev_private_data *dev_data, struct device *dev) {
+
+    if (!dev_data->pdata.backing_file)
+        return 0;
+
+    mutex_init(&dev_data->wb_lock);
+    INIT_WORK(&dev_data->wb_attach, pcd_wb_attach_work);
+    INIT_DELAYED_WORK(&dev_data->wb_work, pcd_wb_work);
+
+    /*
+     * One bit per page, the size of a backed device never changes. Open files may still write
+     * after the remove, so both live as long as the device data and pcd_dev_release() frees them.
+     */
+    dev_data->wb_dirty = kvcalloc(BITS_TO_LONGS(dev_data->nr_pages), sizeof(long), GFP_KERNEL);
+    dev_data->wb_buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (!dev_data->wb_dirty || !dev_data->wb_buf)
+        return -ENOMEM;
+
+    dev_info(dev, "Backed by %s, write-back every %u ms\n", dev_data->pdata.backing_file,
+             jiffies_to_msecs(pcdrv_data.wb_interval));
+
+    /* On remove the last dirty pages reach the file, later writes of open files stay in the buffer */
+    return devm_add_action_or_reset(dev, pcd_wb_release, dev_data);
+}
+
+/* Open the backing file and load its content into the buffer, caller holds wb_lock */
+int pcd_wb_load(struct pcdev_private_data *dev_data) {
+
+    int ret = 0;
+    void *addr;
+    loff_t pos;
+    ssize_t len;
+    unsigned long i;
+    struct page *page;
+    struct file *file;
+
+    file = filp_open(dev_data->pdata.backing_file, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+
+    /* A short file leaves the rest of the buffer as holes, they read back as zeroes */
+    mutex_lock(&dev_data->pcdev_lock);
+    for (i = 0; i < dev_data->nr_pages; i++) {
+        page = pcd_buffer_page(dev_data, i, true);
+        if (IS_ERR(page)) {
+            ret = PTR_ERR(page);
+            break;
+        }
+
+        pos = (loff_t)i << PAGE_SHIFT;
+        addr = kmap(page);
+        len = kernel_read(file, addr, min_t(size_t, PAGE_SIZE, dev_data->pdata.size - pos), &pos);
+        kunmap(page);
+        if (len < 0) {
+            ret = len;
+            break;
+        }
+        if (len < PAGE_SIZE)
+            break;
+    }
+    mutex_unlock(&dev_data->pcdev_lock);
+
+    if (ret) {
+        filp_close(file, NULL);
+        return ret;
+    }
+
+    /* Pairs with pcd_wb_attach(), an opener which sees the file also sees the loaded buffer */
+    smp_store_release(&dev_data->wb_file, file);
+    return 0;
+}
+
+/*
+ * Runs pcd_wb_load() in a kworker: the path is looked up with the kernel's root and credentials
+ * like at probe, not with those of whichever process opens the device first.
+ */
+void pcd_wb_attach_work(struct work_struct *work) {
+
+    struct pcdev_private_data *dev_data = container_of(work, struct pcdev_private_data, wb_attach);
+
+    mutex_lock(&dev_data->wb_lock);
+    if (!dev_data->wb_file && !dev_data->wb_stopped) {
+        dev_data->wb_attach_ret = pcd_wb_load(dev_data);
+        if (dev_data->wb_attach_ret)
+            pr_info("Cannot load backing file %s (%d)\n", dev_data->pdata.backing_file, dev_data->wb_attach_ret);
+    }
+    mutex_unlock(&dev_data->wb_lock);
+}
+
+/* Called on open, the first one loads the backing file and the others wait for it */
+int pcd_wb_attach(struct pcdev_private_data *dev_data) {
+
+    if (smp_load_acquire(&dev_data->wb_file))
+        return 0;
+
+    /* Concurrent first opens share one run of the work */
+    schedule_work(&dev_data->wb_attach);
+    flush_work(&dev_data->wb_attach);
+
+    if (smp_load_acquire(&dev_data->wb_file))
+        return 0;
+
+    /* A failed load is tried again on the next open */
+    return dev_data->wb_attach_ret ? dev_data->wb_attach_ret : -ENODEV;
+}
+
+/* Devres action, stops the write-back, writes what is still dirty and closes the file */
+void pcd_wb_release(void *data) {
+
+    int ret;
+    struct pcdev_private_data *dev_data = data;
+
+    /* No writer may queue the work again once it is cancelled */
+    mutex_lock(&dev_data->pcdev_lock);
+    dev_data->wb_stopped = true;
+    mutex_unlock(&dev_data->pcdev_lock);
+    cancel_delayed_work_sync(&dev_data->wb_work);
+    cancel_work_sync(&dev_data->wb_attach);
+
+    ret = pcd_wb_flush(dev_data, true);
+    if (ret)
+        pr_info("Lost dirty pages of %s (%d)\n", dev_data->pdata.backing_file, ret);
+
+    /* Files still open after the remove see a device without backing file */
+    mutex_lock(&dev_data->wb_lock);
+    if (dev_data->wb_file)
+        filp_close(dev_data->wb_file, NULL);
+    dev_data->wb_file = NULL;
+    mutex_unlock(&dev_data->wb_lock);
+}
+
+/* Mark a page written through the buffer dirty, caller holds pcdev_lock */
+void pcd_wb_mark(struct pcdev_private_data *dev_data, unsigned long index) {
+
+    /* After the remove nothing writes the page back any more */
+    if (dev_data->wb_stopped)
+        return;
+
+    set_bit(index, dev_data->wb_dirty);
+
+    /* Already queued work keeps its timer, so a burst of writes costs one write-back */
+    schedule_delayed_work(&dev_data->wb_work, pcdrv_data.wb_interval);
+}
+
+/* Copy the dirty pages to the backing file, sync also waits for the file system to persist them */
+int pcd_wb_flush(struct pcdev_private_data *dev_data, bool sync) {
+
+    int ret = 0;
+    size_t len;
+    loff_t pos;
+    ssize_t written;
+    unsigned long i;
+    void *addr;
+    struct page *page;
+
+    /* Serializes the work against fsync, it also owns wb_buf */
+    mutex_lock(&dev_data->wb_lock);
+    if (!dev_data->wb_file)
+        goto out;
+
+    for (i = 0; i < dev_data->nr_pages; i++) {
+        /* A page mapped writable changes without a write(), it is copied on every pass */
+        if (!test_bit(i, dev_data->wb_dirty) && !dev_data->wb_mapped)
+            continue;
+
+        mutex_lock(&dev_data->pcdev_lock);
+        page = READ_ONCE(dev_data->pages[i]);
+        if (!test_and_clear_bit(i, dev_data->wb_dirty) && !(page && page_mapped(page))) {
+            mutex_unlock(&dev_data->pcdev_lock);
+            continue;
+        }
+
+        /* A dirty page the shrinker compressed comes back for the copy */
+        if (!page && xa_load(&dev_data->spill, i))
+            page = pcd_buffer_page(dev_data, i, false);
+        if (IS_ERR(page)) {
+            set_bit(i, dev_data->wb_dirty);
+            mutex_unlock(&dev_data->pcdev_lock);
+            ret = PTR_ERR(page);
+            break;
+        }
+
+        /* The copy is taken under the lock, the slow file write runs without it */
+        pos = (loff_t)i << PAGE_SHIFT;
+        len = min_t(size_t, PAGE_SIZE, dev_data->pdata.size - pos);
+        if (page) {
+            addr = kmap_atomic(page);
+            memcpy(dev_data->wb_buf, addr, len);
+            kunmap_atomic(addr);
+        } else {
+            memset(dev_data->wb_buf, 0, len);
+        }
+        mutex_unlock(&dev_data->pcdev_lock);
+
+        written = kernel_write(dev_data->wb_file, dev_data->wb_buf, len, &pos);
+        if (written != len) {
+            /* Keep the page dirty, the next pass tries again */
+            set_bit(i, dev_data->wb_dirty);
+            ret = (written < 0) ? written : -EIO;
+            break;
+        }
+    }
+
+    if (!ret && sync)
+        ret = vfs_fsync(dev_data->wb_file, 0);
+
+out:
+    mutex_unlock(&dev_data->wb_lock);
+    return ret;
+}
+
+/* The delayed work queued by the first write after a write-back */
+void pcd_wb_work(struct work_struct *work) {
+
+    int ret;
+    struct pcdev_private_data *dev_data = container_of(to_delayed_work(work), struct pcdev_private_data, wb_work);
+
+    ret = pcd_wb_flush(dev_data, false);
+    if (ret)
+        pr_info("Write-back to %s failed (%d), retrying\n", dev_data->pdata.backing_file, ret);
+
+    /* Mappings and failed pages aren't queued by a write, the work comes back for them itself */
+    if (ret || dev_data->wb_mapped)
+        schedule_delayed_work(&dev_data->wb_work, pcdrv_data.wb_interval);
+}
+
+/* fsync of the device, a device without backing file has nothing to persist */
+int pcd_fsync(struct file *filp, loff_t start, loff_t end, int datasync) {
+
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+
+    if (!pcdev_data->pdata.backing_file)
+        return 0;
+
+    return pcd_wb_flush(pcdev_data, true);
+}
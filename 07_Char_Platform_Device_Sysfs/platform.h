@@ -6,4 +6,16 @@ struct pcdev_platform_data {
     int size;
     int permission;
     const char *serial_number;
+    bool fifo;                  /* Work as a FIFO instead of a random access buffer */
+    u32 fifo_rd_threshold;      /* Bytes held before blocked readers are woken up */
+    u32 fifo_wr_threshold;      /* Free bytes before blocked writers are woken up */
+    bool frame;                 /* Publish whole frames, readers never see a half written buffer */
+    bool flat;                  /* Back the buffer by one physically contiguous block */
+    bool prealloc;              /* Allocate the whole buffer at probe, the shrinker leaves it alone */
+    bool lock_trylock;          /* O_NONBLOCK readers and writers get -EAGAIN instead of sleeping on the device lock */
+    bool reserved;              /* The buffer is carved out of a reserved-memory region */
+    phys_addr_t reserved_base;  /* Physical address of the carve out */
+    bool persistent;            /* Keep the carve out content at probe, it survives a warm reboot */
+    const char *firmware;       /* Blob the buffer is filled with in the background at probe */
+    const char *backing_file;   /* Write-back mode: file the buffer is loaded from and written back to */
 };
\ No newline at end of file